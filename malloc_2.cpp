@@ -1,32 +1,153 @@
 #include <cstddef>
+#include <cstdint>
 #include <unistd.h>
 #include <limits>
 #include <cstring>
 #include <iostream>
 
+#define NUM_BINS 32         // bin i holds free blocks with 2^i <= size < 2^(i+1)
+#define MIN_SPLIT_SIZE 128  // smallest leftover worth splitting into its own block
+
 struct MallocMataData {
     size_t size;
     bool is_free;
-    MallocMataData* next;
+    MallocMataData* next;  // neighbours by address
     MallocMataData* prev;
+    MallocMataData* bin_next;  // free blocks of the same bin
+    MallocMataData* bin_prev;
 };
 
 static MallocMataData* head = nullptr;
 static MallocMataData* last = nullptr;
+static MallocMataData* bins[NUM_BINS];
 
-void* smalloc(size_t size) {
+unsigned int _get_bin(size_t size) {
+    unsigned int bin = 63 - __builtin_clzll(size);
+    return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+void _bin_insert(MallocMataData* m) {
+    unsigned int bin = _get_bin(m->size);
+    m->is_free = true;
+    m->bin_prev = nullptr;
+    m->bin_next = bins[bin];
+    if (bins[bin]) {
+        bins[bin]->bin_prev = m;
+    }
+    bins[bin] = m;
+}
+
+void _bin_remove(MallocMataData* m) {
+    if (m->bin_prev) {
+        m->bin_prev->bin_next = m->bin_next;
+    } else {
+        bins[_get_bin(m->size)] = m->bin_next;
+    }
+    if (m->bin_next) {
+        m->bin_next->bin_prev = m->bin_prev;
+    }
+    m->is_free = false;
+}
+
+// true when b starts right where a ends, someone else may have moved the break in between.
+bool _is_adjacent(MallocMataData* a, MallocMataData* b) {
+    return (char*)a + sizeof(MallocMataData) + a->size == (char*)b;
+}
+
+// first fit inside the request's own bin, any block of a larger bin fits.
+MallocMataData* _find_free(size_t size) {
+    unsigned int bin = _get_bin(size);
+    for (MallocMataData* current = bins[bin]; current; current = current->bin_next) {
+        if (current->size >= size) return current;
+    }
+    for (bin++; bin < NUM_BINS; bin++) {
+        if (bins[bin]) return bins[bin];
+    }
+    return nullptr;
+}
+
+// cuts the tail of a used block off into a free block of its own.
+void _split(MallocMataData* m, size_t size) {
+    // the new header goes on an 8-byte boundary even when m itself is not on one.
+    char* payload = (char*)m + sizeof(MallocMataData);
+    size = (((uintptr_t)payload + size + 7) & ~(uintptr_t)7) - (uintptr_t)payload;
+    if (m->size < size + sizeof(MallocMataData) + MIN_SPLIT_SIZE) return;
+
+    MallocMataData* rest = (MallocMataData*)((char*)m + sizeof(MallocMataData) + size);
+    rest->size = m->size - size - sizeof(MallocMataData);
+    rest->prev = m;
+    rest->next = m->next;
+    if (m->next) {
+        m->next->prev = rest;
+    } else {
+        last = rest;
+    }
+    m->next = rest;
+    m->size = size;
+
+    // the leftover may border another free block.
+    if (rest->next && rest->next->is_free && _is_adjacent(rest, rest->next)) {
+        MallocMataData* next = rest->next;
+        _bin_remove(next);
+        rest->size += sizeof(MallocMataData) + next->size;
+        rest->next = next->next;
+        if (next->next) {
+            next->next->prev = rest;
+        } else {
+            last = rest;
+        }
+    }
+    _bin_insert(rest);
+}
+
+// merges a block with its next neighbour, neither is in a bin.
+void _absorb_next(MallocMataData* m) {
+    MallocMataData* next = m->next;
+    m->size += sizeof(MallocMataData) + next->size;
+    m->next = next->next;
+    if (next->next) {
+        next->next->prev = m;
+    } else {
+        last = m;
+    }
+}
+
+// memory the break grows over is zero from the first page boundary on, what is left of
+// the page the old break was on may hold data of whoever moved the break before.
+char* _page_up(void* p) {
+    size_t page_size = getpagesize();
+    return (char*)(((uintptr_t)p + page_size - 1) & ~(uintptr_t)(page_size - 1));
+}
+
+// zero_from, when given, is set to the address from which the payload is known to
+// read as zeroes, and left alone when nothing is known.
+void* _smalloc(size_t size, char** zero_from) {
     if (size == 0 || size > 100000000) return nullptr;
 
-    MallocMataData* current = head;
-    while(current != nullptr) {
-        if(current->is_free && current->size >= size) {
-            current->is_free = false;
-            return (char*)current + sizeof(MallocMataData);
+    MallocMataData* current = _find_free(size);
+    if (current) {
+        _bin_remove(current);
+        _split(current, size);
+        return (char*)current + sizeof(MallocMataData);
+    }
+
+    // a free block at the top of the heap only needs the difference.
+    if (last && last->is_free && (char*)last + sizeof(MallocMataData) + last->size == sbrk(0)) {
+        void* old_break = sbrk(size - last->size);
+        if (old_break == (void*)-1) return nullptr;
+        _bin_remove(last);
+        last->size = size;
+        if (zero_from) {
+            *zero_from = _page_up(old_break);
         }
-        current = current->next;
+        return (char*)last + sizeof(MallocMataData);
     }
+
     void* value = sbrk(size + sizeof(MallocMataData));
     if(value == (void *) -1) return nullptr;
+    if (zero_from) {
+        *zero_from = _page_up(value);
+    }
 
     MallocMataData* m = (MallocMataData*) value;
     m->size = size;
@@ -44,6 +165,10 @@ void* smalloc(size_t size) {
     return (char*)value + sizeof(MallocMataData);
 }
 
+void* smalloc(size_t size) {
+    return _smalloc(size, nullptr);
+}
+
 void* scalloc(size_t num, size_t size) {
 
     if (num == 0 || size == 0) return nullptr;
@@ -52,9 +177,15 @@ void* scalloc(size_t num, size_t size) {
 
     if (num * size > 100000000) return nullptr;
 
-    void* data = smalloc(size * num);
+    // only what may have been used before is cleared, fresh pages are left untouched.
+    char* zero_from = nullptr;
+    char* data = (char*)_smalloc(size * num, &zero_from);
     if(!data) return nullptr;
-    std::memset(data, 0, size * num);
+    size_t dirty = size * num;
+    if (zero_from) {
+        dirty = zero_from > data ? std::min((size_t)(zero_from - data), dirty) : 0;
+    }
+    std::memset(data, 0, dirty);
     return data;
 }
 
@@ -62,7 +193,18 @@ void* scalloc(size_t num, size_t size) {
 void sfree(void* p) {
     if (p == nullptr) return;
     MallocMataData* m = (MallocMataData*) ((char*)p - sizeof(MallocMataData));
-    m->is_free = true;
+    if (m->is_free) return;
+
+    if (m->next && m->next->is_free && _is_adjacent(m, m->next)) {
+        _bin_remove(m->next);
+        _absorb_next(m);
+    }
+    if (m->prev && m->prev->is_free && _is_adjacent(m->prev, m)) {
+        m = m->prev;
+        _bin_remove(m);
+        _absorb_next(m);
+    }
+    _bin_insert(m);
 }
 
 
@@ -79,51 +221,22 @@ void* srealloc(void* oldp, size_t size) {
     MallocMataData* old_m = (MallocMataData*) ((char*)oldp - sizeof(MallocMataData));
     if(size <= old_m->size) return oldp;
 
-    MallocMataData* current = head;
-    auto* old_data = (char*)oldp;
-
-    while(current != nullptr) {
-
-        if(current->is_free && current->size >= size) {
-
-            current->is_free = false;
-
-            auto* data = (char*)current + sizeof(MallocMataData);
-            size_t copy_size = (old_m->size < size) ? old_m->size : size;
-            std::memmove(data, old_data, copy_size);
-
-            old_m->is_free = true;
-
-            return data;
-        }
-
-        current = current->next;
-
+    // grow into a free neighbour before moving anywhere.
+    MallocMataData* next = old_m->next;
+    if (next && next->is_free && _is_adjacent(old_m, next)
+        && old_m->size + sizeof(MallocMataData) + next->size >= size) {
+        _bin_remove(next);
+        _absorb_next(old_m);
+        _split(old_m, size);
+        return oldp;
     }
 
-    void* value = sbrk(size + sizeof(MallocMataData));
-    if(value == (void *) -1) return nullptr;
-
-    MallocMataData* m = (MallocMataData*) value;
-    m->size = size;
-    m->is_free = false;
-    m->next = nullptr;
-    m->prev = last;
-
-    if (!head) {
-        head = m;
-    } else {
-        last->next = m;
-    }
-    last = m;
-
-    auto* data = (char*)m + sizeof(MallocMataData);
-    size_t copy_size = (old_m->size < size) ? old_m->size : size;
-    std::memmove(data, old_data, copy_size);
-    old_m->is_free = true;
+    auto* data = (char*)smalloc(size);
+    if(!data) return nullptr;
+    std::memmove(data, oldp, old_m->size);
+    sfree(oldp);
 
     return data;
-
 }
 
 size_t _num_free_blocks() {
@@ -0,0 +1,110 @@
+/*
+ * containers on the buddy heap: BuddyAllocator<T> meets the standard Allocator
+ * requirements and BuddyResource is a std::pmr::memory_resource, both over the
+ * malloc_3 or malloc_4 engine the program is linked with.
+ *
+ *   std::vector<int, BuddyAllocator<int>> v;
+ *   std::pmr::unordered_map<int, int> m(buddy_resource());
+ *
+ * containers pass the size back on deallocation, so blocks go back through
+ * sfree_sized. alignments over BUDDY_ALIGN come from smemalign and go back through
+ * sfree. with SMALLOC_NAMESPACE defined, as for the engine, everything here lives
+ * in that namespace and runs on that copy of the heap.
+ */
+#ifndef MALLOC_ALLOCATOR_H
+#define MALLOC_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <new>
+#include <memory_resource>
+
+#define BUDDY_ALIGN 16  // smalloc aligns a payload of at least this size to it
+
+#ifdef SMALLOC_NAMESPACE
+namespace SMALLOC_NAMESPACE {
+#endif
+
+void* smalloc(size_t size);
+void sfree(void* p);
+void sfree_sized(void* p, size_t size);
+void* smemalign(size_t alignment, size_t size);
+
+// the 8 byte slabs are only 8 byte aligned, so a request is at least as big as its
+// alignment. that also covers a size of 0, which smalloc refuses.
+inline size_t _buddy_size(size_t size, size_t alignment) {
+    return std::max(size, alignment);
+}
+
+inline void* _buddy_allocate(size_t size, size_t alignment) {
+    size = _buddy_size(size, alignment);
+    void* p = alignment > BUDDY_ALIGN ? smemalign(alignment, size) : smalloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+inline void _buddy_deallocate(void* p, size_t size, size_t alignment) {
+    if (alignment > BUDDY_ALIGN) {
+        sfree(p);
+    } else {
+        sfree_sized(p, _buddy_size(size, alignment));
+    }
+}
+
+template <typename T>
+class BuddyAllocator {
+public:
+    typedef T value_type;
+
+    BuddyAllocator() noexcept = default;
+    template <typename U>
+    BuddyAllocator(const BuddyAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) throw std::bad_array_new_length();
+        return (T*)_buddy_allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        _buddy_deallocate(p, n * sizeof(T), alignof(T));
+    }
+};
+
+// every allocator shares the one heap, memory from one is freed by any other.
+template <typename T, typename U>
+bool operator==(const BuddyAllocator<T>&, const BuddyAllocator<U>&) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const BuddyAllocator<T>&, const BuddyAllocator<U>&) noexcept {
+    return false;
+}
+
+class BuddyResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        return _buddy_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        _buddy_deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const BuddyResource*>(&other) != nullptr;
+    }
+};
+
+// the resource for pmr containers, it lives as long as the program.
+inline BuddyResource* buddy_resource() noexcept {
+    static BuddyResource resource;
+    return &resource;
+}
+
+#ifdef SMALLOC_NAMESPACE
+}  // namespace SMALLOC_NAMESPACE
+#endif
+
+#endif
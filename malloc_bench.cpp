@@ -0,0 +1,663 @@
+/*
+ * benchmarks one allocator generation, or glibc, over a set of workloads.
+ *
+ *   g++ -std=c++17 -O2 -DBENCH_VARIANT=3 malloc_bench.cpp malloc_3.cpp -o bench_3 -lpthread
+ *   g++ -std=c++17 -O2 -DBENCH_VARIANT=0 malloc_bench.cpp -o bench_glibc -lpthread
+ *   ./bench_3 [workload] [scale]
+ *   ./bench_3 replay trace.bin [points]
+ *
+ * every workload runs in a child process of its own, so the heap starts empty and
+ * the peak rss belongs to that workload alone. one line is printed per workload:
+ * ops/sec, p50/p99/p999 latency of single calls, peak rss and, when the variant
+ * keeps statistics, the heap state just before the workload frees what is still
+ * live. fragmentation is free bytes over all bytes the heap holds.
+ *
+ * replay drives the allocator with a trace recorded by _trace_start, in time order
+ * and from a single thread, and prints the heap size and free bytes at evenly
+ * spaced points of the trace as "curve" lines before its summary.
+ *
+ * malloc_1 never frees, so only the small object workload and replay run against it.
+ * malloc_1 and malloc_2 are not thread safe and skip the threaded workload.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT 4
+#endif
+
+#define MAX_SAMPLES (1 << 22)  // latency samples kept per workload
+#define RING_SIZE 4096         // pointers in flight between a producer and its consumer
+#define TRACE_MAGIC 0x52544d53u  // "SMTR", first word of a trace file
+
+#if BENCH_VARIANT == 0
+#include <malloc.h>
+#else
+void* smalloc(size_t size);
+#if BENCH_VARIANT >= 3
+void* smemalign(size_t alignment, size_t size);
+#endif
+#if BENCH_VARIANT >= 2
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+#endif
+#endif
+
+// the allocator under test, whatever subset of the interface it has.
+
+#if BENCH_VARIANT == 1
+// malloc_1 keeps no statistics, and the bench's own containers grow the same break
+// through glibc. only the moves of the break made inside smalloc are counted.
+static size_t sbrk_blocks;
+static size_t sbrk_bytes;
+
+void* _sbrk_malloc(size_t size) {
+    char* before = (char*)sbrk(0);
+    void* p = smalloc(size);
+    if (p) {
+        sbrk_blocks++;
+        sbrk_bytes += (char*)sbrk(0) - before;
+    }
+    return p;
+}
+#endif
+
+void* bench_malloc(size_t size) {
+#if BENCH_VARIANT == 0
+    return malloc(size);
+#elif BENCH_VARIANT == 1
+    return _sbrk_malloc(size);
+#else
+    return smalloc(size);
+#endif
+}
+
+void* bench_calloc(size_t num, size_t size) {
+#if BENCH_VARIANT == 0
+    return calloc(num, size);
+#elif BENCH_VARIANT == 1
+    void* p = _sbrk_malloc(num * size);
+    if (p) {
+        memset(p, 0, num * size);
+    }
+    return p;
+#else
+    return scalloc(num, size);
+#endif
+}
+
+void bench_free(void* p) {
+#if BENCH_VARIANT == 0
+    free(p);
+#elif BENCH_VARIANT >= 2
+    sfree(p);
+#else
+    (void)p;
+#endif
+}
+
+void* bench_realloc(void* p, size_t old_size, size_t size) {
+#if BENCH_VARIANT == 0
+    (void)old_size;
+    return realloc(p, size);
+#elif BENCH_VARIANT == 1
+    void* q = _sbrk_malloc(size);
+    if (q && p) {
+        memcpy(q, p, std::min(old_size, size));
+    }
+    return q;
+#else
+    (void)old_size;
+    return srealloc(p, size);
+#endif
+}
+
+// malloc_1 and malloc_2 cannot align, replay gives them the plain size.
+void* bench_memalign(size_t alignment, size_t size) {
+#if BENCH_VARIANT == 0
+    return memalign(alignment, size);
+#elif BENCH_VARIANT >= 3
+    return smemalign(alignment, size);
+#else
+    (void)alignment;
+    return bench_malloc(size);
+#endif
+}
+
+// bookkeeping memory comes straight from mmap, so it never shares a heap with the
+// allocator under test.
+void* _bench_map(size_t size) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+uint64_t _now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t _rand(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// sizes spread evenly over powers of two between min and max.
+size_t _rand_size(uint64_t* state, size_t min, size_t max) {
+    unsigned int lo = 63 - __builtin_clzll(min);
+    unsigned int hi = 63 - __builtin_clzll(max);
+    size_t size = (size_t)1 << (lo + _rand(state) % (hi - lo + 1));
+    size += _rand(state) % size;
+    return std::min(std::max(size, min), max);
+}
+
+struct Samples {
+    uint32_t* ns;
+    size_t capacity;
+    size_t count;
+    size_t seen;
+};
+
+void _record(Samples* samples, uint64_t start) {
+    uint64_t ns = _now_ns() - start;
+    size_t i = samples->seen++;
+    // reservoir sampling keeps an even spread once the buffer is full.
+    if (i >= samples->capacity) {
+        i = (i * 0x9e3779b97f4a7c15ULL >> 11) % samples->seen;
+        if (i >= samples->capacity) return;
+    } else {
+        samples->count++;
+    }
+    samples->ns[i] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+struct Result {
+    size_t ops;
+    size_t failures;
+    size_t heap_blocks;
+    size_t heap_bytes;  // payload and metadata bytes the heap holds
+    size_t free_bytes;
+    size_t peak_heap_bytes;
+};
+
+void _sample_heap(Result* r) {
+#if BENCH_VARIANT == 0
+    struct mallinfo2 info = mallinfo2();
+    r->heap_blocks = info.ordblks + info.hblks;
+    r->heap_bytes = info.arena + info.hblkhd;
+    r->free_bytes = info.fordblks;
+#elif BENCH_VARIANT >= 2
+    r->heap_blocks = _num_allocated_blocks();
+    r->heap_bytes = _num_allocated_bytes() + _num_meta_data_bytes();
+    r->free_bytes = _num_free_bytes();
+#else
+    r->heap_blocks = sbrk_blocks;
+    r->heap_bytes = sbrk_bytes;
+#endif
+    r->peak_heap_bytes = std::max(r->peak_heap_bytes, r->heap_bytes);
+}
+
+#define TIMED(samples, call) do { uint64_t _start = _now_ns(); call; _record(samples, _start); } while (0)
+
+// batches of 16..64 byte objects freed in random order.
+Result bench_small(Samples* samples, size_t scale) {
+    const size_t batch = 10000;
+    void** slots = (void**)_bench_map(batch * sizeof(void*));
+    uint64_t rng = 1;
+    Result r = {};
+    for (size_t round = 0; round < 50 * scale; round++) {
+        for (size_t i = 0; i < batch; i++) {
+            size_t size = 16 + _rand(&rng) % 49;
+            TIMED(samples, slots[i] = bench_malloc(size));
+            if (slots[i]) {
+                *(char*)slots[i] = 1;
+            } else {
+                r.failures++;
+            }
+        }
+        _sample_heap(&r);
+        for (size_t i = batch - 1; i > 0; i--) {
+            std::swap(slots[i], slots[_rand(&rng) % (i + 1)]);
+        }
+        for (size_t i = 0; i < batch; i++) {
+            TIMED(samples, bench_free(slots[i]));
+        }
+        r.ops += 2 * batch;
+    }
+    return r;
+}
+
+// random sizes with random lifetimes over a fixed number of live slots.
+Result bench_random(Samples* samples, size_t scale) {
+    const size_t live = 50000;
+    void** slots = (void**)_bench_map(live * sizeof(void*));
+    uint64_t rng = 2;
+    Result r = {};
+    for (size_t op = 0; op < 2000000 * scale; op++) {
+        size_t i = _rand(&rng) % live;
+        if (slots[i]) {
+            TIMED(samples, bench_free(slots[i]));
+            slots[i] = nullptr;
+        } else {
+            size_t size = _rand_size(&rng, 8, 64 * 1024);
+            TIMED(samples, slots[i] = bench_malloc(size));
+            if (slots[i]) {
+                memset(slots[i], 1, std::min(size, (size_t)64));
+            } else {
+                r.failures++;
+            }
+        }
+        r.ops++;
+    }
+    _sample_heap(&r);
+    for (size_t i = 0; i < live; i++) {
+        bench_free(slots[i]);
+    }
+    return r;
+}
+
+struct Ring {
+    void* slots[RING_SIZE];
+    std::atomic<size_t> head;  // next slot the consumer reads
+    std::atomic<size_t> tail;  // next slot the producer writes
+    size_t ops;
+    size_t failures;
+    Samples producer;
+    Samples consumer;
+};
+
+void* _producer(void* arg) {
+    Ring* ring = (Ring*)arg;
+    uint64_t rng = (uintptr_t)arg;
+    for (size_t op = 0; op < ring->ops; op++) {
+        size_t size = _rand_size(&rng, 16, 4096);
+        void* p;
+        TIMED(&ring->producer, p = bench_malloc(size));
+        if (!p) {
+            ring->failures++;
+        }
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail - ring->head.load(std::memory_order_acquire) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[tail % RING_SIZE] = p;
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+    return nullptr;
+}
+
+void* _consumer(void* arg) {
+    Ring* ring = (Ring*)arg;
+    for (size_t op = 0; op < ring->ops; op++) {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (head == ring->tail.load(std::memory_order_acquire)) {
+            sched_yield();
+        }
+        void* p = ring->slots[head % RING_SIZE];
+        ring->head.store(head + 1, std::memory_order_release);
+        TIMED(&ring->consumer, bench_free(p));
+    }
+    return nullptr;
+}
+
+// pairs of threads, one allocating and one freeing what the other allocated.
+Result bench_prodcons(Samples* samples, size_t scale) {
+    const size_t pairs = 4;
+    Ring* rings = (Ring*)_bench_map(pairs * sizeof(Ring));
+    pthread_t threads[pairs * 2];
+    for (size_t i = 0; i < pairs; i++) {
+        rings[i].ops = 500000 * scale;
+        for (Samples* s : {&rings[i].producer, &rings[i].consumer}) {
+            s->capacity = MAX_SAMPLES / pairs / 2;
+            s->ns = (uint32_t*)_bench_map(s->capacity * sizeof(uint32_t));
+        }
+        pthread_create(&threads[2 * i], nullptr, _producer, &rings[i]);
+        pthread_create(&threads[2 * i + 1], nullptr, _consumer, &rings[i]);
+    }
+    Result r = {};
+    for (size_t i = 0; i < pairs; i++) {
+        pthread_join(threads[2 * i], nullptr);
+        pthread_join(threads[2 * i + 1], nullptr);
+        for (Samples* s : {&rings[i].producer, &rings[i].consumer}) {
+            memcpy(samples->ns + samples->count, s->ns, s->count * sizeof(uint32_t));
+            samples->count += s->count;
+        }
+        r.ops += 2 * rings[i].ops;
+        r.failures += rings[i].failures;
+    }
+    _sample_heap(&r);
+    return r;
+}
+
+// buffers grown by half at a time from 16 bytes to 1MB.
+Result bench_realloc(Samples* samples, size_t scale) {
+    const size_t buffers = 64;
+    void** slots = (void**)_bench_map(buffers * sizeof(void*));
+    size_t* sizes = (size_t*)_bench_map(buffers * sizeof(size_t));
+    uint64_t rng = 3;
+    Result r = {};
+    for (size_t round = 0; round < 20 * scale; round++) {
+        for (size_t i = 0; i < buffers; i++) {
+            sizes[i] = 16;
+            slots[i] = bench_malloc(sizes[i]);
+        }
+        for (bool is_growing = true; is_growing; ) {
+            is_growing = false;
+            for (size_t i = 0; i < buffers; i++) {
+                if (!slots[i] || sizes[i] >= (1 << 20) || _rand(&rng) % 4 == 0) continue;
+                size_t size = sizes[i] + sizes[i] / 2;
+                void* p;
+                TIMED(samples, p = bench_realloc(slots[i], sizes[i], size));
+                r.ops++;
+                if (!p) {
+                    r.failures++;
+                    continue;
+                }
+                ((char*)p)[size - 1] = 1;
+                slots[i] = p;
+                sizes[i] = size;
+                is_growing = true;
+            }
+        }
+        _sample_heap(&r);
+        for (size_t i = 0; i < buffers; i++) {
+            bench_free(slots[i]);
+        }
+    }
+    return r;
+}
+
+// 256KB..8MB buffers with every page touched once.
+Result bench_large(Samples* samples, size_t scale) {
+    const size_t live = 16;
+    void* slots[live] = {};
+    size_t sizes[live] = {};
+    uint64_t rng = 4;
+    Result r = {};
+    for (size_t op = 0; op < 4000 * scale; op++) {
+        size_t i = _rand(&rng) % live;
+        if (slots[i]) {
+            TIMED(samples, bench_free(slots[i]));
+            slots[i] = nullptr;
+        } else {
+            sizes[i] = _rand_size(&rng, 256 * 1024, 8 * 1024 * 1024);
+            TIMED(samples, slots[i] = bench_malloc(sizes[i]));
+            if (!slots[i]) {
+                r.failures++;
+                continue;
+            }
+            for (size_t offset = 0; offset < sizes[i]; offset += 4096) {
+                ((char*)slots[i])[offset] = 1;
+            }
+        }
+        r.ops++;
+    }
+    _sample_heap(&r);
+    for (size_t i = 0; i < live; i++) {
+        bench_free(slots[i]);
+    }
+    return r;
+}
+
+// zeroed buffers of 1KB..256KB that are read back before they are freed.
+Result bench_calloc(Samples* samples, size_t scale) {
+    const size_t live = 256;
+    void** slots = (void**)_bench_map(live * sizeof(void*));
+    uint64_t rng = 5;
+    Result r = {};
+    for (size_t op = 0; op < 200000 * scale; op++) {
+        size_t i = _rand(&rng) % live;
+        if (slots[i]) {
+            TIMED(samples, bench_free(slots[i]));
+            slots[i] = nullptr;
+        } else {
+            size_t size = _rand_size(&rng, 1024, 256 * 1024);
+            TIMED(samples, slots[i] = bench_calloc(1, size));
+            if (!slots[i] || ((char*)slots[i])[size - 1]) {
+                r.failures++;
+            } else {
+                ((char*)slots[i])[size - 1] = 1;
+            }
+        }
+        r.ops++;
+    }
+    _sample_heap(&r);
+    for (size_t i = 0; i < live; i++) {
+        bench_free(slots[i]);
+    }
+    return r;
+}
+
+// must match the records written by malloc_3 and malloc_4.
+enum TraceOp : unsigned char {
+    TRACE_MALLOC, TRACE_CALLOC, TRACE_MEMALIGN, TRACE_REALLOC_FROM, TRACE_REALLOC, TRACE_FREE
+};
+
+struct TraceRecord {
+    uint64_t time_ns;
+    uint64_t ptr;
+    uint32_t size;
+    uint16_t thread;
+    unsigned char op;
+    unsigned char align_shift;
+};
+
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t record_size;
+};
+
+static const char* replay_path;
+static size_t replay_points = 100;
+
+struct ReplayBlock {
+    void* p;
+    size_t size;
+};
+
+Result bench_replay(Samples* samples, size_t scale) {
+    (void)scale;
+    Result r = {};
+    int fd = open(replay_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(TraceHeader)) {
+        perror(replay_path);
+        exit(1);
+    }
+    char* file = (char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    TraceHeader* header = (TraceHeader*)file;
+    if (file == MAP_FAILED || header->magic != TRACE_MAGIC || header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a trace\n", replay_path);
+        exit(1);
+    }
+    TraceRecord* records = (TraceRecord*)(file + sizeof(TraceHeader));
+    size_t count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+
+    // threads write their records in batches, only each batch is in time order.
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [records](uint32_t a, uint32_t b) {
+        return records[a].time_ns < records[b].time_ns;
+    });
+
+    std::unordered_map<uint64_t, ReplayBlock> live;
+    live.reserve(count / 2 + 1);
+    size_t interval = std::max(count / std::max(replay_points, (size_t)1), (size_t)1);
+    uint64_t start = _now_ns();
+    size_t unmatched = 0;
+    for (size_t i = 0; i < count; i++) {
+        TraceRecord* record = &records[order[i]];
+        void* p = nullptr;
+        switch (record->op) {
+        case TRACE_MALLOC:
+            TIMED(samples, p = bench_malloc(record->size));
+            break;
+        case TRACE_CALLOC:
+            TIMED(samples, p = bench_calloc(1, record->size));
+            break;
+        case TRACE_MEMALIGN:
+            TIMED(samples, p = bench_memalign((size_t)1 << record->align_shift, record->size));
+            break;
+        case TRACE_REALLOC: {
+            // written right before it by the same thread.
+            TraceRecord* from = order[i] ? &records[order[i] - 1] : nullptr;
+            auto it = from && from->op == TRACE_REALLOC_FROM ? live.find(from->ptr) : live.end();
+            if (it == live.end()) {
+                unmatched++;
+                TIMED(samples, p = bench_malloc(record->size));
+                break;
+            }
+            ReplayBlock old = it->second;
+            live.erase(it);
+            TIMED(samples, p = bench_realloc(old.p, old.size, record->size));
+            break;
+        }
+        case TRACE_FREE: {
+            auto it = live.find(record->ptr);
+            if (it == live.end()) {
+                unmatched++;
+                break;
+            }
+            TIMED(samples, bench_free(it->second.p));
+            live.erase(it);
+            break;
+        }
+        default:
+            continue;
+        }
+        if (record->op == TRACE_FREE) {
+            r.ops++;
+        } else {
+            r.ops++;
+            if (!p) {
+                r.failures++;
+            } else {
+                *(char*)p = 1;
+                live[record->ptr] = {p, record->size};
+            }
+        }
+        if (i % interval == 0 || i == count - 1) {
+            _sample_heap(&r);
+            printf("curve %zu %.3fms heap %zu free %zu\n", i, (_now_ns() - start) / 1e6,
+                   r.heap_bytes, r.free_bytes);
+        }
+    }
+    if (unmatched) {
+        // pointers from before the trace, or reused by another thread within the
+        // few nanoseconds between a call and its timestamp.
+        printf("%zu frees or reallocs of unknown pointers were skipped\n", unmatched);
+    }
+    return r;
+}
+
+struct Workload {
+    const char* name;
+    Result (*run)(Samples*, size_t);
+    int min_variant;  // oldest generation able to run it, glibc runs everything
+};
+
+static const Workload workloads[] = {
+    {"small", bench_small, 1},
+    {"random", bench_random, 2},
+    {"prodcons", bench_prodcons, 3},
+    {"realloc", bench_realloc, 2},
+    {"large", bench_large, 2},
+    {"calloc", bench_calloc, 2},
+};
+
+void _report(const Workload* w, Result r, Samples* samples, uint64_t ns) {
+    std::sort(samples->ns, samples->ns + samples->count);
+    auto percentile = [samples](double q) -> unsigned int {
+        return samples->count ? samples->ns[(size_t)(q * (samples->count - 1))] : 0;
+    };
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-9s %10.0f ops/s  p50 %6uns  p99 %7uns  p999 %8uns  rss %7ldKB",
+           w->name, r.ops * 1e9 / ns, percentile(0.5), percentile(0.99), percentile(0.999),
+           usage.ru_maxrss);
+    printf("  blocks %zu  heap %zuKB  frag %.3f", r.heap_blocks, r.heap_bytes / 1024,
+           r.heap_bytes ? (double)r.free_bytes / r.heap_bytes : 0.0);
+    if (r.peak_heap_bytes != r.heap_bytes) {
+        printf("  peak %zuKB", r.peak_heap_bytes / 1024);
+    }
+    if (r.failures) {
+        printf("  failed %zu", r.failures);
+    }
+    printf("\n");
+}
+
+void _run(const Workload* w, size_t scale) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        Samples samples = {(uint32_t*)_bench_map(MAX_SAMPLES * sizeof(uint32_t)), MAX_SAMPLES, 0, 0};
+        uint64_t start = _now_ns();
+        Result r = w->run(&samples, scale);
+        _report(w, r, &samples, _now_ns() - start);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("%-9s crashed (status %d)\n", w->name, status);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2 && !strcmp(argv[1], "replay")) {
+        replay_path = argv[2];
+        if (argc > 3) {
+            replay_points = strtoul(argv[3], nullptr, 10);
+        }
+        static const Workload replay = {"replay", bench_replay, 1};
+        printf("variant %d, replaying %s\n", BENCH_VARIANT, replay_path);
+        _run(&replay, 1);
+        return 0;
+    }
+
+    const char* only = argc > 1 ? argv[1] : nullptr;
+    size_t scale = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+    if (only && !strcmp(only, "all")) {
+        only = nullptr;
+    }
+    printf("variant %d, scale %zu\n", BENCH_VARIANT, scale);
+
+    for (const Workload& w : workloads) {
+        if (only && strcmp(only, w.name)) continue;
+        if (BENCH_VARIANT && BENCH_VARIANT < w.min_variant) {
+            printf("%-9s skipped\n", w.name);
+            continue;
+        }
+        _run(&w, scale);
+    }
+    return 0;
+}
@@ -0,0 +1,2822 @@
+/*
+ * the buddy engine of malloc_3 and malloc_4. each includes it once, after setting its
+ * options, and then defines what sets it apart: _counted_bytes, how much of a heap
+ * block counts towards bytes_allocated, and with HUGE_PAGES _map_huge, where the
+ * mappings of huge blocks come from.
+ */
+#ifndef MALLOC_ENGINE_H
+#define MALLOC_ENGINE_H
+
+#include <cstddef>
+#include <unistd.h>
+#include <limits>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <cmath>
+#include <cstdio>
+#include <climits>
+#include <csignal>
+#include <execinfo.h>
+#include <sys/uio.h>
+
+// the geometry of the heap can be set at build time, e.g. -DMAX_DEG=8 -DMIN_BLOCK_SIZE=64
+// for a heap of small objects. defining SMALLOC_NAMESPACE as well puts the whole allocator
+// in that namespace, so copies built with different flags live side by side in a program,
+// each with its own superblocks, arenas and thread caches:
+//   g++ -c -DSMALLOC_NAMESPACE=small_heap -DMAX_DEG=8 -DMIN_BLOCK_SIZE=64 malloc_3.cpp -o small_heap.o
+// the geometry sizes the static tables of the heap and is folded into the shifts of
+// every size to degree lookup, so each heap is its own build of the engine.
+#ifndef MAX_DEG
+#define MAX_DEG 10
+#endif
+#ifndef MIN_BLOCK_SIZE
+#define MIN_BLOCK_SIZE 128    // a power of two
+#endif
+#ifndef MIN_BLOCK_NUM
+#define MIN_BLOCK_NUM 32      // max-order blocks per superblock, a power of two up to 64
+#endif
+#define MIN_BLOCK_SHIFT __builtin_ctz(MIN_BLOCK_SIZE)
+#define SUPERBLOCK_SIZE ((size_t)MIN_BLOCK_NUM * ((size_t)MIN_BLOCK_SIZE << MAX_DEG))
+#ifndef MAX_SUPERBLOCKS
+#define MAX_SUPERBLOCKS 256   // superblocks reserved for the heap, 1GB of address space by default
+#endif
+#define PURGE_THRESHOLD 8     // free max-order blocks kept resident before purging
+#define PURGE_ADVICE MADV_DONTNEED  // MADV_FREE is cheaper but leaves RSS until memory pressure
+#define MAX_ARENAS 64         // one arena per cpu, up to this many
+#define REMOTE_FREE_MAX 256   // blocks queued on an arena before a freeing thread drains them
+#define DEFER_MAX_COUNT 8     // freed blocks per degree an arena keeps uncoalesced, 0 coalesces right away
+
+#define TCACHE_MAX_DEG 3      // blocks up to 1KB are cached per thread
+#define TCACHE_MAX_COUNT 32   // cached blocks per degree before flushing
+#define TCACHE_BATCH 16       // blocks moved per refill / flush
+#define FREE_BATCH_CHUNK 64   // blocks sfree_batch hands back to the heap per lock
+
+#define SLAB_DEG 5             // slabs are 4KB buddy blocks
+#define SLAB_SIZE (MIN_BLOCK_SIZE << SLAB_DEG)
+#define SLAB_SHIFT (MIN_BLOCK_SHIFT + SLAB_DEG)
+#define SLAB_CLASSES 5         // 8, 16, 32, 48 and 64 bytes
+#define SLAB_MAX_SIZE 64
+#define SLAB_OBJECTS_MAX (SLAB_SIZE / 8)
+
+#define TRACE_BUFFER 4096  // records a thread collects before writing them out
+#define TRACE_MAGIC 0x52544d53u  // "SMTR", first word of a trace file
+
+#define PROF_SAMPLES (1 << 16)   // sampled blocks the profiler follows at once, a power of two
+#define PROF_STACKS 4096         // distinct stacks it keeps, a power of two
+#define PROF_DEPTH 32            // frames kept of a stack
+#define PROF_RECHECK (1L << 20)  // bytes a thread allocates between checks while the profiler is off
+
+#define REGION_CHUNK_SIZE (_get_block_size(MAX_DEG) - BLOCK_HEADER_SIZE - sizeof(RegionChunk))  // default chunk, a max-order block
+#define REGION_ALIGN 16          // alignment of region allocations
+
+#define ALIGNED_DEG 0xffffffffu  // degree of the stub header in front of an aligned payload
+
+#ifndef COMPACT_META
+#define COMPACT_META 0  // 1 keeps the degree and state of heap blocks in a side table instead of a header
+#endif
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0    // 1 maps blocks of 4MB and more with huge pages, through _map_huge
+#endif
+#ifndef THP_HEAP
+#define THP_HEAP 0      // 1 advises the superblocks of the heap for transparent huge pages
+#endif
+
+#define MMAP_CACHE_CLASSES 40              // 4 size classes per power of two from the max block size
+#define MMAP_CACHE_WAYS 4                  // cached mappings per size class
+#define MMAP_CACHE_MAX_BYTES (64UL << 20)  // default limit of idle mapped bytes
+#define MMAP_CACHE_MAX_AGE_MS 2000         // default age after which a mapping is unmapped
+#define MAPPED_TABLE_MIN 512               // initial slots of the table of mappings
+#define MAPPED_NONE ((size_t)-1 >> 1)      // end of the empty slots of the table of mappings
+
+#ifdef SMALLOC_NAMESPACE
+namespace SMALLOC_NAMESPACE {
+#endif
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)  // 2MB
+
+#define MMAP_MAGIC 0x6d6d6170u             // tags the header of an mmap'd block
+#define ALIGNED_MAGIC 0x616c676eu          // tags the stub header of an aligned payload
+
+struct MallocMetaData {
+    unsigned int degree;  // slot in mapped_table on an mmap'd block
+    int size;
+    MallocMetaData* next;
+    size_t map_size;  // length of the mapping of an mmap'd block
+    // single bits, so that the header stays 32 bytes and payloads after it 16 byte aligned.
+    bool is_mmap : 1;
+    bool is_free : 1;
+    bool is_cached : 1;
+    bool is_sampled : 1;  // followed by the heap profiler, on heap blocks only without COMPACT_META
+    bool is_huge : 1;
+    unsigned int magic;  // MMAP_MAGIC / ALIGNED_MAGIC ^ page number, on mmap'd blocks and stubs
+};
+
+// heap blocks start with a MallocMetaData, unless COMPACT_META moves their degree and
+// state out to a byte per minimum block of the superblock. mmap'd blocks always have one.
+#if COMPACT_META
+#define BLOCK_HEADER_SIZE ((size_t)0)
+#else
+#define BLOCK_HEADER_SIZE sizeof(MallocMetaData)
+#endif
+
+// the bytes a heap block of degree counts for in bytes_allocated, its requested size
+// is in its header by then when it has one.
+long _counted_bytes(MallocMetaData* block, unsigned int degree);
+#if HUGE_PAGES
+// maps map_size bytes, a multiple of HUGE_PAGE_SIZE, backed by huge pages if it can.
+void* _map_huge(size_t map_size);
+#endif
+
+// state of a heap block, the high bits of its side table byte. BLOCK_SAMPLED is or'd
+// into BLOCK_ALLOCATED while the heap profiler follows the block.
+enum BlockState : unsigned char {
+    BLOCK_FREE = 0x00, BLOCK_ALLOCATED = 0x10, BLOCK_CACHED = 0x20, BLOCK_SAMPLED = 0x40
+};
+#define BLOCK_DEGREE_MASK 0x0f
+
+// one traced call. a realloc is a TRACE_REALLOC_FROM record with the old pointer
+// right followed in the file by a TRACE_REALLOC record with the new one.
+enum TraceOp : unsigned char {
+    TRACE_MALLOC, TRACE_CALLOC, TRACE_MEMALIGN, TRACE_REALLOC_FROM, TRACE_REALLOC, TRACE_FREE
+};
+
+struct TraceRecord {
+    uint64_t time_ns;
+    uint64_t ptr;
+    uint32_t size;
+    uint16_t thread;
+    unsigned char op;
+    unsigned char align_shift;  // log2 of the alignment of a TRACE_MEMALIGN
+};
+
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t record_size;
+};
+
+// per thread cache of small blocks, the common alloc/free path touches nothing else.
+// the counters are written only by the owning thread and read by the stats functions.
+struct ThreadCache {
+    MallocMetaData* bins[TCACHE_MAX_DEG + 1];
+    unsigned int counts[TCACHE_MAX_DEG + 1];
+    void* slab_bins[SLAB_CLASSES];  // objects linked through their first word
+    unsigned int slab_counts[SLAB_CLASSES];
+    std::atomic<long> active_blocks;
+    std::atomic<long> bytes_allocated;
+    std::atomic<long> cached_blocks;
+    std::atomic<long> cached_bytes;
+    // what the four counters above were when last folded into the snapshot totals.
+    long published_blocks;
+    long published_bytes;
+    long published_cached_blocks;
+    long published_cached_bytes;
+    TraceRecord* trace_buf;  // mapped on the first traced call
+    unsigned int trace_count;
+    uint16_t trace_thread;
+    std::atomic<bool> is_tracing;  // the owner is appending a record
+    long prof_countdown;  // bytes left to allocate before the next sample
+    uint64_t prof_seed;
+    ThreadCache* next;
+    ThreadCache* prev;
+    bool is_registered;
+};
+
+// a slab of same-sized objects carved from one buddy block, the objects carry no
+// header. it starts with an ordinary MallocMetaData so it goes back to the buddy
+// system like any other block.
+struct Slab {
+    MallocMetaData meta;
+    Slab* next;  // partial slabs of the same class
+    Slab* prev;
+    unsigned int size_class;
+    unsigned int capacity;
+    unsigned int free_objects;
+    uint64_t free_bits[SLAB_OBJECTS_MAX / 64];  // bit i is set when object i is in the slab
+    // bit i is set while object i is handed out, any thread may clear it on a free.
+    std::atomic<uint64_t> used_bits[SLAB_OBJECTS_MAX / 64];
+};
+#define SLAB_HEADER_SIZE ((sizeof(Slab) + 15) & ~(size_t)15)
+
+// a recently freed mapping, kept to serve a later allocation of the same size class.
+struct MmapCacheEntry {
+    MallocMetaData* block;
+    long long freed_at;  // ms
+};
+
+// a block of the heap or a mapping, as _heap_walk reports it.
+struct HeapBlock {
+    void* start;
+    size_t block_size;    // bytes it spans, header included
+    size_t size;          // bytes asked for, 0 when not known or not allocated
+    unsigned int degree;  // MAX_DEG + 1 for a mapping
+    unsigned char state;  // BLOCK_FREE, BLOCK_ALLOCATED or BLOCK_CACHED
+    bool is_mmap;
+    bool is_slab;         // size is then the bytes of the objects out of the slab
+};
+
+// what _heap_fragmentation finds in one walk of the heap.
+struct HeapFragmentation {
+    size_t allocated_bytes;   // allocated blocks and mappings, headers included
+    size_t sized_bytes;       // the part of them whose requested size is known
+    size_t requested_bytes;   // bytes asked for in that part
+    size_t internal_waste;    // sized_bytes - requested_bytes
+    double internal_ratio;    // internal_waste / sized_bytes
+    size_t cached_bytes;      // blocks in thread caches and mappings in the mmap cache
+    size_t free_bytes;        // free heap blocks
+    size_t free_blocks[MAX_DEG + 1];  // free heap blocks of each degree
+    size_t largest_free;      // the biggest free heap block, 0 when there is none
+    double external_ratio;    // 1 - largest_free / free_bytes, 0 when nothing is free
+};
+
+// a stack that allocated sampled blocks, with what they add up to.
+struct ProfStack {
+    void* frames[PROF_DEPTH];
+    unsigned int depth;  // 0 for an empty slot
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+};
+
+// a chunk a region bump allocates from, its payload follows the header.
+struct alignas(REGION_ALIGN) RegionChunk {
+    RegionChunk* next;
+    size_t size;  // bytes of payload
+};
+
+// a bump allocator for memory that is all released at once. its chunks stay on the
+// list across resets, current is the one being carved.
+struct Region {
+    RegionChunk* chunks;
+    RegionChunk* current;
+    char* top;
+    char* end;
+    size_t chunk_size;
+};
+
+struct ProfSample {
+    MallocMetaData* block;  // nullptr for an empty slot
+    size_t size;
+    ProfStack* stack;
+};
+
+// totals read by _heap_snapshot.
+struct HeapSnapshot {
+    long active_blocks;       // blocks, mappings and slab objects handed out
+    long allocated_bytes;     // their bytes, as _num_allocated_bytes counts them
+    long cached_blocks;       // blocks and slab objects in thread caches
+    long cached_bytes;
+    size_t heap_bytes;        // superblocks committed to the heap
+    size_t free_heap_bytes;   // free blocks in the arenas, headers included
+    size_t mapped_blocks;     // mappings, live and in the mmap cache
+    size_t mapped_bytes;
+};
+
+// layout of the free maps, one bit per block of every degree in a superblock.
+constexpr size_t _map_words(unsigned int degree) {
+    return (((size_t)MIN_BLOCK_NUM << (MAX_DEG - degree)) + 63) / 64;
+}
+
+constexpr size_t _map_offset(unsigned int degree) {
+    return degree == 0 ? 0 : _map_offset(degree - 1) + _map_words(degree - 1);
+}
+
+constexpr size_t _summary_words(unsigned int degree) {
+    return (_map_words(degree) + 63) / 64;
+}
+
+constexpr size_t _summary_offset(unsigned int degree) {
+    return degree == 0 ? 0 : _summary_offset(degree - 1) + _summary_words(degree - 1);
+}
+
+// a share of the heap with free maps and a lock of its own, so threads running on
+// different cpus rarely wait for each other. a thread allocates from the arena of
+// its cpu, a block always goes back to the arena that owns its superblock.
+struct Arena {
+    pthread_mutex_t lock;
+    // bit s of degree d is set when superblock s has a free block of degree d.
+    uint64_t superblock_map[MAX_DEG + 1][(MAX_SUPERBLOCKS + 63) / 64];
+    size_t free_count[MAX_DEG + 1];
+    unsigned int free_degrees;  // bit d is set when free_count[d] > 0
+    size_t dirty_blocks;  // free max-order blocks whose payload is still resident
+    std::atomic<size_t> free_bytes;  // written under the lock, read by _heap_snapshot
+    uint64_t owned[(MAX_SUPERBLOCKS + 63) / 64];  // bit s is set when superblock s is ours
+    // freed blocks set aside cached instead of coalesced, handed out again first so that
+    // churn of one size neither splits nor merges. max-order blocks have no buddy.
+    MallocMetaData* deferred[MAX_DEG];
+    unsigned int deferred_count[MAX_DEG];
+    // blocks freed by threads running on other cpus, pushed without the lock and
+    // coalesced by the next allocation from the arena. on a line of their own, the
+    // freeing threads write it.
+    alignas(64) std::atomic<MallocMetaData*> remote_frees;
+    std::atomic<size_t> remote_count;
+};
+
+// the heap is a range of superblocks, each one MIN_BLOCK_NUM max-order blocks
+// aligned to its size, so the buddy of a block never leaves its superblock.
+// the free blocks are kept in bitmaps instead of lists: bit i of degree d is set
+// when the i-th block of that degree in the superblock is free, and every word of
+// a map has a summary bit so the lowest free block is found without walking anything.
+struct SuperBlock {
+    char* base;
+    Arena* arena;  // set when the superblock is added to the heap
+    uint64_t free_map[_map_offset(MAX_DEG + 1)];
+    uint64_t free_summary[_summary_offset(MAX_DEG + 1)];
+    size_t free_count[MAX_DEG + 1];
+    uint64_t purged;  // bit i is set when max-order block i has no resident payload
+    uint64_t slab_map[(SUPERBLOCK_SIZE / SLAB_SIZE + 63) / 64];  // bit i is set when the i-th slab sized block is a slab
+    bool is_thp;  // advised for transparent huge pages
+#if COMPACT_META
+    unsigned char block_info[SUPERBLOCK_SIZE / MIN_BLOCK_SIZE];  // degree | state of the block starting there
+#endif
+};
+static_assert(MIN_BLOCK_NUM <= 64, "the max-order blocks of a superblock must fit in one word");
+static_assert(sizeof(MallocMetaData) % 16 == 0, "a payload after a header is 16 byte aligned");
+static_assert(!(MIN_BLOCK_NUM & (MIN_BLOCK_NUM - 1)), "superblocks are aligned to their size");
+static_assert(!(MIN_BLOCK_SIZE & (MIN_BLOCK_SIZE - 1)) && MIN_BLOCK_SIZE >= sizeof(MallocMetaData),
+              "a minimum block holds a header");
+static_assert(((size_t)MIN_BLOCK_SIZE << MAX_DEG) >= 4096, "max-order blocks are purged past their first page");
+static_assert(TCACHE_MAX_DEG <= MAX_DEG && SLAB_DEG <= MAX_DEG, "cached blocks and slabs are buddy blocks");
+#if COMPACT_META
+static_assert(MAX_DEG <= BLOCK_DEGREE_MASK, "the degree of a block fits the low bits of its side table byte");
+#endif
+
+// superblock s starts at heap_base + s * SUPERBLOCK_SIZE. the whole range is reserved on
+// the first growth, a superblock is only committed while it is in the table.
+static SuperBlock superblocks[MAX_SUPERBLOCKS];
+static Arena arenas[MAX_ARENAS];
+static unsigned int arena_num = 1;  // set with the thread cache key
+static size_t superblock_num;  // one past the highest superblock in use
+static char* heap_base;
+// totals of threads that already exited, the live ones are kept in their cache.
+static long active_blocks_num;
+static long bytes_allocated;
+
+// guards the superblock table and the heap reservation, the totals above and the thread
+// cache list. it is taken after the lock of an arena.
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static ThreadCache* tcache_list = nullptr;
+static thread_local ThreadCache tcache;
+
+// -1 when no trace is being recorded. records are appended lock-free to the
+// buffer of the calling thread, a full buffer goes out with one O_APPEND write.
+static std::atomic<int> trace_fd(-1);
+
+// about one allocation per prof_interval bytes is sampled, 0 when the profiler is off.
+// a sampled block has an entry in prof_samples, found by open addressing, until it is freed.
+static std::atomic<size_t> prof_interval;
+static std::atomic<bool> prof_dump_pending;  // raised by the dump signal
+// guards everything below, nothing else is locked while it is held.
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t prof_rate;  // the interval the samples were taken at
+static char prof_dump_path[PATH_MAX];
+static unsigned int prof_dump_num;
+static ProfStack prof_stacks[PROF_STACKS];
+static ProfSample prof_samples[PROF_SAMPLES];
+static size_t prof_sample_num;
+
+// guards everything below, objects in thread caches are not counted as free here.
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static const unsigned int slab_sizes[SLAB_CLASSES] = {8, 16, 32, 48, 64};
+static Slab* slab_partial[SLAB_CLASSES];
+static size_t slab_num;
+static size_t slab_objects;
+static size_t slab_free_objects;
+static size_t slab_free_bytes;
+
+// guards everything below, mappings are cached by their exact (size class) length.
+static pthread_mutex_t mmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static MmapCacheEntry mmap_cache[MMAP_CACHE_CLASSES][MMAP_CACHE_WAYS];
+static size_t mmap_cache_blocks;
+static size_t mmap_cache_bytes;
+static size_t mmap_cache_max_bytes = MMAP_CACHE_MAX_BYTES;
+static long long mmap_cache_max_age = MMAP_CACHE_MAX_AGE_MS;
+static long long mmap_cache_swept_at;
+static size_t mmap_cache_hits;
+static size_t mmap_cache_misses;
+static std::atomic<long> mapped_blocks_num;  // live and cached mappings, each has a header
+
+// every mapping with a header, live or cached, so _heap_walk can find them. a mapping
+// keeps its slot in its degree, an empty slot holds the next empty one shifted left
+// with the low bit set. mapped_lock guards the table, it is taken after mmap_cache_lock.
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t* mapped_table;
+static size_t mapped_slots;  // slots ever used
+static size_t mapped_capacity;
+static size_t mapped_empty = MAPPED_NONE;
+
+// totals for _heap_snapshot. a thread folds its counters in whenever it takes a lock
+// anyway, so the common path never writes a shared line.
+static std::atomic<long> published_blocks;
+static std::atomic<long> published_bytes;
+static std::atomic<long> published_cached_blocks;
+static std::atomic<long> published_cached_bytes;
+static std::atomic<size_t> heap_bytes;    // superblocks committed to the heap
+static std::atomic<size_t> mapped_bytes;  // live and cached mappings
+
+static size_t thp_heap_bytes;  // guarded by heap_lock
+
+
+constexpr size_t _get_block_size(unsigned int degree) {
+    return (size_t)MIN_BLOCK_SIZE << degree;
+}
+
+// smallest degree whose blocks hold size bytes after the header, past MAX_DEG when none does.
+constexpr unsigned int _get_degree(size_t size) {
+    return size + BLOCK_HEADER_SIZE <= MIN_BLOCK_SIZE ? 0
+        : 64 - __builtin_clzll(size + BLOCK_HEADER_SIZE - 1) - MIN_BLOCK_SHIFT;
+}
+static_assert(_get_degree(MIN_BLOCK_SIZE - BLOCK_HEADER_SIZE) == 0 && _get_degree(MIN_BLOCK_SIZE - BLOCK_HEADER_SIZE + 1) == 1 &&
+              _get_degree(_get_block_size(MAX_DEG) - BLOCK_HEADER_SIZE) == MAX_DEG, "size to degree");
+static_assert(_get_degree(sizeof(RegionChunk) + REGION_CHUNK_SIZE) == MAX_DEG, "a default region chunk is a max-order block");
+
+size_t _get_superblock_index(MallocMetaData* block) {
+    return (size_t)((char*)block - heap_base) / SUPERBLOCK_SIZE;
+}
+
+size_t _get_block_index(SuperBlock* sb, MallocMetaData* block, unsigned int degree) {
+    return (size_t)((char*)block - sb->base) >> (MIN_BLOCK_SHIFT + degree);
+}
+
+void _add_free_block(MallocMetaData* block, unsigned int degree) {
+    size_t s = _get_superblock_index(block);
+    SuperBlock* sb = &superblocks[s];
+    size_t index = _get_block_index(sb, block, degree);
+    size_t word = index / 64;
+    sb->free_map[_map_offset(degree) + word] |= 1ULL << (index % 64);
+    sb->free_summary[_summary_offset(degree) + word / 64] |= 1ULL << (word % 64);
+    Arena* arena = sb->arena;
+    if (!sb->free_count[degree]++) {
+        arena->superblock_map[degree][s / 64] |= 1ULL << (s % 64);
+    }
+    if (degree == MAX_DEG && !(sb->purged & (1ULL << index))) {
+        arena->dirty_blocks++;
+    }
+    arena->free_count[degree]++;
+    arena->free_degrees |= 1U << degree;
+    arena->free_bytes.store(arena->free_bytes.load(std::memory_order_relaxed) + _get_block_size(degree),
+                            std::memory_order_relaxed);
+}
+
+void _remove_free_block(MallocMetaData* block, unsigned int degree) {
+    size_t s = _get_superblock_index(block);
+    SuperBlock* sb = &superblocks[s];
+    size_t index = _get_block_index(sb, block, degree);
+    size_t word = index / 64;
+    uint64_t* bits = &sb->free_map[_map_offset(degree) + word];
+    *bits &= ~(1ULL << (index % 64));
+    if (!*bits) {
+        sb->free_summary[_summary_offset(degree) + word / 64] &= ~(1ULL << (word % 64));
+    }
+    Arena* arena = sb->arena;
+    if (!--sb->free_count[degree]) {
+        arena->superblock_map[degree][s / 64] &= ~(1ULL << (s % 64));
+    }
+    if (degree == MAX_DEG) {
+        // the pages of a purged block come back zeroed on first touch.
+        if (sb->purged & (1ULL << index)) {
+            sb->purged &= ~(1ULL << index);
+        } else {
+            arena->dirty_blocks--;
+        }
+    }
+    if (!--arena->free_count[degree]) {
+        arena->free_degrees &= ~(1U << degree);
+    }
+    arena->free_bytes.store(arena->free_bytes.load(std::memory_order_relaxed) - _get_block_size(degree),
+                            std::memory_order_relaxed);
+}
+
+// true when p lies in a superblock of the heap, no lock is needed.
+bool _in_heap(void* p) {
+    char* heap = heap_base;
+    if (!heap || (char*)p < heap) return false;
+    size_t s = (size_t)((char*)p - heap) / SUPERBLOCK_SIZE;
+    return s < MAX_SUPERBLOCKS && superblocks[s].base;
+}
+
+#if COMPACT_META
+unsigned char* _get_block_info(MallocMetaData* block) {
+    SuperBlock* sb = &superblocks[_get_superblock_index(block)];
+    return &sb->block_info[(size_t)((char*)block - sb->base) >> MIN_BLOCK_SHIFT];
+}
+#endif
+
+unsigned int _get_block_degree(MallocMetaData* block) {
+#if COMPACT_META
+    return *_get_block_info(block) & BLOCK_DEGREE_MASK;
+#else
+    return block->degree;
+#endif
+}
+
+unsigned char _get_block_state(MallocMetaData* block) {
+#if COMPACT_META
+    return *_get_block_info(block) & ~BLOCK_DEGREE_MASK;
+#else
+    return block->is_cached ? BLOCK_CACHED : block->is_free ? BLOCK_FREE
+        : block->is_sampled ? BLOCK_ALLOCATED | BLOCK_SAMPLED : BLOCK_ALLOCATED;
+#endif
+}
+
+void _set_block(MallocMetaData* block, unsigned int degree, unsigned char state) {
+#if COMPACT_META
+    *_get_block_info(block) = degree | state;
+#else
+    block->degree = degree;
+    block->is_mmap = false;
+    block->is_free = state == BLOCK_FREE;
+    block->is_cached = state == BLOCK_CACHED;
+    block->is_sampled = state & BLOCK_SAMPLED;
+#endif
+}
+
+// the link of a heap block in a thread cache. without a header it takes the first
+// word of the payload, which nobody uses while the block is cached.
+MallocMetaData** _block_next(MallocMetaData* block) {
+#if COMPACT_META
+    return (MallocMetaData**)block;
+#else
+    return &block->next;
+#endif
+}
+
+bool _is_mapped(MallocMetaData* block) {
+#if COMPACT_META
+    return !_in_heap(block);
+#else
+    return block->is_mmap;
+#endif
+}
+
+// returns the block p was handed out from, following the stub of an aligned payload.
+MallocMetaData* _get_block(void* p) {
+#if COMPACT_META
+    if (_in_heap(p)) return (MallocMetaData*)p;
+#endif
+    MallocMetaData* block = (MallocMetaData*)((char*)p - sizeof(MallocMetaData));
+    if (block->degree == ALIGNED_DEG) {
+        block = block->next;
+    }
+    return block;
+}
+
+size_t _get_block_span(MallocMetaData* block) {
+    return _is_mapped(block) ? block->map_size : _get_block_size(_get_block_degree(block));
+}
+
+bool _is_free_block(MallocMetaData* block, unsigned int degree) {
+    SuperBlock* sb = &superblocks[_get_superblock_index(block)];
+    size_t index = _get_block_index(sb, block, degree);
+    return sb->free_map[_map_offset(degree) + index / 64] & (1ULL << (index % 64));
+}
+
+MallocMetaData* _lowest_free_block(Arena* arena, unsigned int degree) {
+    for (size_t i = 0; i < (MAX_SUPERBLOCKS + 63) / 64; i++) {
+        if (!arena->superblock_map[degree][i]) continue;
+        SuperBlock* sb = &superblocks[i * 64 + __builtin_ctzll(arena->superblock_map[degree][i])];
+        const uint64_t* summary = &sb->free_summary[_summary_offset(degree)];
+        for (size_t j = 0; j < _summary_words(degree); j++) {
+            if (!summary[j]) continue;
+            size_t word = j * 64 + __builtin_ctzll(summary[j]);
+            size_t index = word * 64 + __builtin_ctzll(sb->free_map[_map_offset(degree) + word]);
+            return (MallocMetaData*)(sb->base + (index << (MIN_BLOCK_SHIFT + degree)));
+        }
+    }
+    return nullptr;
+}
+
+bool _find_block(MallocMetaData* block) {
+    if ((char*)block < heap_base || _get_superblock_index(block) >= MAX_SUPERBLOCKS ||
+        !superblocks[_get_superblock_index(block)].base) {
+        return false;
+    }
+    for (unsigned int i = 0; i <= MAX_DEG; ++i) {
+        if (((size_t)((char*)block - heap_base) & (_get_block_size(i) - 1)) == 0 &&
+            _is_free_block(block, i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void* _get_buddy(MallocMetaData* block, unsigned int degree) {
+    char* blockAddr = (char*)block;
+    size_t blockSize = _get_block_size(degree);
+    size_t addrVal = (size_t)blockAddr;
+    size_t buddyAddr = addrVal ^ blockSize;
+    return (void*)buddyAddr;
+}
+
+void _purge_block(MallocMetaData* block) {
+    // the header page stays mapped so the block keeps a usable MallocMetaData.
+    size_t page_size = getpagesize();
+    madvise((char*)block + page_size, _get_block_size(MAX_DEG) - page_size, PURGE_ADVICE);
+}
+
+size_t _release_free_memory(Arena* arena) {
+/*
+ * gives the memory of the free max-order blocks of an arena back to the os, the
+ * arena's lock must be held. every fully free superblock of the arena is decommitted
+ * and its slot left for allocateSuperBlock to commit again, the payload of every other
+ * free max-order block is madvised away.
+ */
+    size_t released = 0;
+    pthread_mutex_lock(&heap_lock);
+    for (size_t w = 0; w < (MAX_SUPERBLOCKS + 63) / 64; w++) {
+        for (uint64_t owned = arena->owned[w]; owned; owned &= owned - 1) {
+            size_t s = w * 64 + __builtin_ctzll(owned);
+            SuperBlock* sb = &superblocks[s];
+            if (sb->free_count[MAX_DEG] != MIN_BLOCK_NUM) continue;
+            // back to the reserved state of the rest of the heap, without pages or access.
+            if (madvise(sb->base, SUPERBLOCK_SIZE, MADV_DONTNEED) ||
+                mprotect(sb->base, SUPERBLOCK_SIZE, PROT_NONE)) continue;
+            for (int i = 0; i < MIN_BLOCK_NUM; i++) {
+                _remove_free_block((MallocMetaData*)(sb->base + i * _get_block_size(MAX_DEG)), MAX_DEG);
+            }
+            arena->owned[w] &= ~(1ULL << (s % 64));
+            sb->base = nullptr;
+            sb->purged = 0;
+            if (sb->is_thp) {
+                thp_heap_bytes -= SUPERBLOCK_SIZE;
+                sb->is_thp = false;
+            }
+            released += SUPERBLOCK_SIZE;
+            heap_bytes -= SUPERBLOCK_SIZE;
+        }
+    }
+    while (superblock_num > 0 && !superblocks[superblock_num - 1].base) {
+        superblock_num--;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    for (size_t w = 0; w < (MAX_SUPERBLOCKS + 63) / 64 && arena->dirty_blocks; w++) {
+        for (uint64_t owned = arena->owned[w]; owned && arena->dirty_blocks; owned &= owned - 1) {
+            SuperBlock* sb = &superblocks[w * 64 + __builtin_ctzll(owned)];
+            uint64_t dirty = sb->free_map[_map_offset(MAX_DEG)] & ~sb->purged;
+            while (dirty) {
+                unsigned int i = __builtin_ctzll(dirty);
+                dirty &= dirty - 1;
+                _purge_block((MallocMetaData*)(sb->base + i * _get_block_size(MAX_DEG)));
+                sb->purged |= 1ULL << i;
+                arena->dirty_blocks--;
+                released += _get_block_size(MAX_DEG) - getpagesize();
+            }
+        }
+    }
+    return released;
+}
+
+void uniteFreeBuddies(MallocMetaData* block) {
+    // only the free maps are updated, the headers of free blocks are never touched.
+    // the lock of the arena of the block must be held.
+    unsigned int degree = _get_block_degree(block);
+    while (degree < MAX_DEG) {
+        MallocMetaData* buddy = (MallocMetaData*)_get_buddy(block, degree);
+        if (!_is_free_block(buddy, degree)) break;
+        _remove_free_block(buddy, degree);
+        block = ((char*)block < (char*)buddy) ? block : buddy;
+        degree++;
+    }
+    _add_free_block(block, degree);
+    Arena* arena = superblocks[_get_superblock_index(block)].arena;
+    if (arena->dirty_blocks > PURGE_THRESHOLD) {
+        _release_free_memory(arena);
+    }
+}
+
+// takes a freed block of the arena back, the arena's lock must be held. it is only
+// coalesced once DEFER_MAX_COUNT blocks of its degree already wait uncoalesced.
+void _put_free_block(Arena* arena, MallocMetaData* block, unsigned int degree) {
+    if (degree < MAX_DEG && arena->deferred_count[degree] < DEFER_MAX_COUNT) {
+        _set_block(block, degree, BLOCK_CACHED);
+        *_block_next(block) = arena->deferred[degree];
+        arena->deferred[degree] = block;
+        arena->deferred_count[degree]++;
+        return;
+    }
+    _set_block(block, degree, BLOCK_FREE);
+    uniteFreeBuddies(block);
+}
+
+// coalesces every block the arena set aside, its lock must be held.
+void _coalesce_deferred(Arena* arena) {
+    for (unsigned int d = 0; d < MAX_DEG; d++) {
+        while (arena->deferred[d]) {
+            MallocMetaData* block = arena->deferred[d];
+            arena->deferred[d] = *_block_next(block);
+            _set_block(block, d, BLOCK_FREE);
+            uniteFreeBuddies(block);
+        }
+        arena->deferred_count[d] = 0;
+    }
+}
+
+// takes back the blocks other threads queued on the arena, its lock must be held.
+void _drain_remote_frees(Arena* arena) {
+    if (!arena->remote_frees.load(std::memory_order_relaxed)) return;
+    MallocMetaData* block = arena->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    size_t drained = 0;
+    while (block) {
+        MallocMetaData* next = *_block_next(block);
+        _put_free_block(arena, block, _get_block_degree(block));
+        block = next;
+        drained++;
+    }
+    arena->remote_count.fetch_sub(drained, std::memory_order_relaxed);
+}
+
+void splitBuddies(MallocMetaData* block, unsigned int degree) {
+/*
+ * receives a block that is not in the free maps and splits it in two,
+ * the upper buddy becomes a free block of degree - 1.
+ */
+    MallocMetaData* buddy = (MallocMetaData*)_get_buddy(block, degree - 1);
+    _add_free_block(buddy, degree - 1);
+}
+
+bool _grow_block(MallocMetaData* block, unsigned int degree) {
+/*
+ * grows an allocated block in place to the given degree by absorbing its free
+ * higher buddies, the lock of its arena must be held. the block has to be the lower buddy
+ * at every level, and nothing changes if one of the buddies is not free.
+ */
+    if (degree > MAX_DEG || ((size_t)block & (_get_block_size(degree) - 1))) return false;
+    unsigned int old_deg = _get_block_degree(block);
+    for (unsigned int d = old_deg; d < degree; d++) {
+        if (!_is_free_block((MallocMetaData*)((char*)block + _get_block_size(d)), d)) return false;
+    }
+    for (unsigned int d = old_deg; d < degree; d++) {
+        _remove_free_block((MallocMetaData*)((char*)block + _get_block_size(d)), d);
+    }
+    _set_block(block, degree, BLOCK_ALLOCATED);
+    return true;
+}
+
+
+// reserves the address range of MAX_SUPERBLOCKS superblocks, aligned to their size,
+// heap_lock must be held. nothing in it can be touched before it is committed.
+bool _reserve_heap() {
+    size_t size = (size_t)MAX_SUPERBLOCKS * SUPERBLOCK_SIZE;
+    char* p = (char*)mmap(nullptr, size + SUPERBLOCK_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                          -1, 0);
+    if (p == MAP_FAILED) return false;
+    char* base = (char*)(((uintptr_t)p + SUPERBLOCK_SIZE - 1) & ~(uintptr_t)(SUPERBLOCK_SIZE - 1));
+    if (base > p) {
+        munmap(p, base - p);
+    }
+    munmap(base + size, p + SUPERBLOCK_SIZE - base);
+    heap_base = base;
+    return true;
+}
+
+bool allocateSuperBlock(Arena* arena) {
+/*
+ * commits the lowest free superblock of the heap reservation and gives it to the
+ * arena, whose lock must be held. only the free map bits of its max-order blocks are
+ * set, no header is written and no page is touched, so the allocation that triggers
+ * the growth pays a single syscall, and with THP_HEAP one more to advise it for
+ * transparent huge pages. being 4MB aligned, it is made of whole huge pages. the first
+ * growth reserves the heap as well.
+ */
+    pthread_mutex_lock(&heap_lock);
+    if (!heap_base && !_reserve_heap()) {
+        pthread_mutex_unlock(&heap_lock);
+        return false;
+    }
+    size_t s = 0;
+    while (s < MAX_SUPERBLOCKS && superblocks[s].base) {
+        s++;
+    }
+    char* ptr = heap_base + s * SUPERBLOCK_SIZE;
+    if (s == MAX_SUPERBLOCKS || mprotect(ptr, SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE)) {
+        pthread_mutex_unlock(&heap_lock);
+        return false;
+    }
+
+    SuperBlock* sb = &superblocks[s];
+    sb->base = ptr;
+    sb->arena = arena;
+    // freshly committed pages are not resident yet, there is nothing to purge.
+    sb->purged = ~0ULL >> (64 - MIN_BLOCK_NUM);
+    sb->is_thp = THP_HEAP && madvise(ptr, SUPERBLOCK_SIZE, MADV_HUGEPAGE) == 0;
+    if (sb->is_thp) {
+        thp_heap_bytes += SUPERBLOCK_SIZE;
+    }
+    if (s >= superblock_num) {
+        superblock_num = s + 1;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    heap_bytes += SUPERBLOCK_SIZE;
+    arena->owned[s / 64] |= 1ULL << (s % 64);
+    for (int i = 0; i < MIN_BLOCK_NUM; i++) {
+        _add_free_block((MallocMetaData*)(ptr + i * _get_block_size(MAX_DEG)), MAX_DEG);
+    }
+    return true;
+}
+
+// takes a set aside block of the given degree out of an arena, nullptr when there is none.
+MallocMetaData* _take_deferred(Arena* arena, unsigned int d) {
+    MallocMetaData* block = d < MAX_DEG ? arena->deferred[d] : nullptr;
+    if (block) {
+        arena->deferred[d] = *_block_next(block);
+        arena->deferred_count[d]--;
+        _set_block(block, d, BLOCK_ALLOCATED);
+    }
+    return block;
+}
+
+// the free degrees of an arena from d up. when none is left the set aside blocks are
+// coalesced, and the arena grows when that frees nothing big enough.
+unsigned int _fitting_degrees(Arena* arena, unsigned int d) {
+    unsigned int fitting = arena->free_degrees >> d;
+    if (!fitting) {
+        _coalesce_deferred(arena);
+        fitting = arena->free_degrees >> d;
+    }
+    if (!fitting && allocateSuperBlock(arena)) {
+        fitting = arena->free_degrees >> d;
+    }
+    return fitting;
+}
+
+// takes a free block of the given degree out of an arena, a set aside one if any or
+// else the lowest one, the arena's lock must be held. is_zeroed, when given, tells
+// whether everything past the first page of the block reads as zeroes.
+MallocMetaData* _alloc_block(Arena* arena, unsigned int d, bool* is_zeroed = nullptr) {
+    if (d > MAX_DEG) return nullptr;
+    _drain_remote_frees(arena);
+    MallocMetaData* deferred = _take_deferred(arena, d);
+    if (deferred) {
+        if (is_zeroed) {
+            *is_zeroed = false;
+        }
+        return deferred;
+    }
+    unsigned int fitting = _fitting_degrees(arena, d);
+    if (!fitting) return nullptr;
+    unsigned int D = d + __builtin_ctz(fitting);
+    MallocMetaData* current = _lowest_free_block(arena, D);
+    if (is_zeroed) {
+        // a purged max-order block comes back zeroed, except the header page it keeps.
+        SuperBlock* sb = &superblocks[_get_superblock_index(current)];
+        *is_zeroed = D == MAX_DEG && PURGE_ADVICE == MADV_DONTNEED
+            && (sb->purged & (1ULL << _get_block_index(sb, current, MAX_DEG)));
+    }
+    _remove_free_block(current, D);
+    while (D > d) {
+        splitBuddies(current, D);
+        D--;
+    }
+    _set_block(current, d, BLOCK_ALLOCATED);
+    return current;
+}
+
+size_t _alloc_run(Arena* arena, unsigned int d, size_t count, void** out) {
+/*
+ * cuts up to count blocks of degree d out of a single free block of the arena, the
+ * smallest one that holds them all or else the biggest there is, and writes their
+ * payloads to out. what is left goes back to the free maps, the arena's lock must be
+ * held. set aside blocks of degree d are handed out first, instead of a cut.
+ * returns how many blocks were taken, 0 when the heap cannot grow.
+ */
+    _drain_remote_frees(arena);
+    size_t deferred = 0;
+    MallocMetaData* block;
+    while (deferred < count && (block = _take_deferred(arena, d))) {
+        out[deferred++] = (char*)block + BLOCK_HEADER_SIZE;
+    }
+    if (deferred) return deferred;
+    unsigned int fitting = _fitting_degrees(arena, d);
+    if (!fitting) return 0;
+    unsigned int wanted = d;
+    while (wanted < MAX_DEG && ((size_t)1 << (wanted - d)) < count) {
+        wanted++;
+    }
+    unsigned int above = arena->free_degrees >> wanted;
+    unsigned int D = above ? wanted + __builtin_ctz(above) : d + 31 - __builtin_clz(fitting);
+    block = _lowest_free_block(arena, D);
+    _remove_free_block(block, D);
+
+    size_t pieces = (size_t)1 << (D - d);
+    size_t taken = std::min(count, pieces);
+    for (size_t i = 0; i < taken; i++) {
+        MallocMetaData* piece = (MallocMetaData*)((char*)block + (i << (MIN_BLOCK_SHIFT + d)));
+        _set_block(piece, d, BLOCK_ALLOCATED);
+        out[i] = (char*)piece + BLOCK_HEADER_SIZE;
+    }
+    // the tail splits into the largest aligned buddies, each one's buddy was just taken.
+    for (size_t i = taken; i < pieces; i += (size_t)1 << __builtin_ctzll(i)) {
+        _add_free_block((MallocMetaData*)((char*)block + (i << (MIN_BLOCK_SHIFT + d))), d + __builtin_ctzll(i));
+    }
+    return taken;
+}
+
+// the arena of the cpu the caller runs on.
+Arena* _get_arena() {
+    int cpu = sched_getcpu();
+    return &arenas[cpu < 0 ? 0 : (unsigned int)cpu % arena_num];
+}
+
+Arena* _get_block_arena(MallocMetaData* block) {
+    return superblocks[_get_superblock_index(block)].arena;
+}
+
+// queues a block freed away from its arena, the arena's lock is not taken.
+void _push_remote_free(Arena* arena, MallocMetaData* block, unsigned int degree) {
+    _set_block(block, degree, BLOCK_CACHED);
+    // counted before the block is published, so a drain that takes it never subtracts
+    // it from a count that does not hold it yet.
+    size_t count = arena->remote_count.fetch_add(1, std::memory_order_relaxed) + 1;
+    MallocMetaData* head = arena->remote_frees.load(std::memory_order_relaxed);
+    do {
+        *_block_next(block) = head;
+    } while (!arena->remote_frees.compare_exchange_weak(head, block, std::memory_order_release,
+                                                        std::memory_order_relaxed));
+    // an arena nobody allocates from anymore would keep them for good, past
+    // REMOTE_FREE_MAX they are drained here when the lock happens to be free.
+    if (count >= REMOTE_FREE_MAX &&
+        pthread_mutex_trylock(&arena->lock) == 0) {
+        _drain_remote_frees(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+// gives an allocated heap block back. a block of the caller's arena is put back
+// under its lock, taken on first use and left held in *locked for the next blocks,
+// one of another arena goes to that arena's remote queue.
+void _return_block(MallocMetaData* block, unsigned int degree, Arena* own, Arena** locked) {
+    Arena* arena = _get_block_arena(block);
+    if (arena != own) {
+        _push_remote_free(arena, block, degree);
+        return;
+    }
+    if (!*locked) {
+        pthread_mutex_lock(&own->lock);
+        *locked = own;
+    }
+    _put_free_block(own, block, degree);
+}
+
+void _tcache_add(std::atomic<long>& counter, long delta) {
+    // only the owning thread writes, so no read-modify-write is needed.
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void _publish_counter(const std::atomic<long>& counter, long* published, std::atomic<long>& total) {
+    long value = counter.load(std::memory_order_relaxed);
+    if (value != *published) {
+        total.fetch_add(value - *published, std::memory_order_relaxed);
+        *published = value;
+    }
+}
+
+// folds what the thread's counters moved since the last call into the snapshot totals.
+void _tcache_publish(ThreadCache* cache) {
+    _publish_counter(cache->active_blocks, &cache->published_blocks, published_blocks);
+    _publish_counter(cache->bytes_allocated, &cache->published_bytes, published_bytes);
+    _publish_counter(cache->cached_blocks, &cache->published_cached_blocks, published_cached_blocks);
+    _publish_counter(cache->cached_bytes, &cache->published_cached_bytes, published_cached_bytes);
+}
+
+unsigned int _get_slab_class(size_t size) {
+    return size <= 32 ? (size <= 8 ? 0 : size <= 16 ? 1 : 2) : (size <= 48 ? 3 : 4);
+}
+
+// returns the slab holding p, or nullptr when p is not a slab object. slab bits only
+// change while no object of the slab is handed out, so no lock is needed.
+Slab* _get_slab(void* p) {
+    char* heap = heap_base;
+    if (!heap || (char*)p < heap) return nullptr;
+    size_t s = (size_t)((char*)p - heap) / SUPERBLOCK_SIZE;
+    if (s >= MAX_SUPERBLOCKS || !superblocks[s].base) return nullptr;
+    size_t index = (size_t)((char*)p - superblocks[s].base) >> SLAB_SHIFT;
+    if (!(superblocks[s].slab_map[index / 64] & (1ULL << (index % 64)))) return nullptr;
+    return (Slab*)(superblocks[s].base + (index << SLAB_SHIFT));
+}
+
+void _set_slab_bit(Slab* slab, bool is_slab) {
+    SuperBlock* sb = &superblocks[_get_superblock_index((MallocMetaData*)slab)];
+    size_t index = (size_t)((char*)slab - sb->base) >> SLAB_SHIFT;
+    if (is_slab) {
+        sb->slab_map[index / 64] |= 1ULL << (index % 64);
+    } else {
+        sb->slab_map[index / 64] &= ~(1ULL << (index % 64));
+    }
+}
+
+void _slab_link(Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = slab_partial[slab->size_class];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    slab_partial[slab->size_class] = slab;
+}
+
+void _slab_unlink(Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        slab_partial[slab->size_class] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = nullptr;
+}
+
+// carves a new slab out of a buddy block, slab_lock must be held.
+Slab* _slab_create(unsigned int c) {
+    Arena* arena = _get_arena();
+    pthread_mutex_lock(&arena->lock);
+    Slab* slab = (Slab*)_alloc_block(arena, SLAB_DEG);
+    pthread_mutex_unlock(&arena->lock);
+    if (!slab) return nullptr;
+    slab->size_class = c;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab_sizes[c];
+    slab->free_objects = slab->capacity;
+    memset(slab->free_bits, 0, sizeof(slab->free_bits));
+    memset((void*)slab->used_bits, 0, sizeof(slab->used_bits));
+    for (unsigned int i = 0; i < slab->capacity; i++) {
+        slab->free_bits[i / 64] |= 1ULL << (i % 64);
+    }
+    _set_slab_bit(slab, true);
+    _slab_link(slab);
+    slab_num++;
+    slab_objects += slab->capacity;
+    slab_free_objects += slab->capacity;
+    slab_free_bytes += slab->capacity * slab_sizes[c];
+    return slab;
+}
+
+// gives an empty slab back to the buddy system, slab_lock must be held.
+void _slab_destroy(Slab* slab) {
+    unsigned int c = slab->size_class;
+    _slab_unlink(slab);
+    _set_slab_bit(slab, false);
+    slab_num--;
+    slab_objects -= slab->capacity;
+    slab_free_objects -= slab->capacity;
+    slab_free_bytes -= slab->capacity * slab_sizes[c];
+    Arena* locked = nullptr;
+    _return_block(&slab->meta, SLAB_DEG, _get_arena(), &locked);
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+unsigned int _get_slab_index(Slab* slab, void* object) {
+    return ((char*)object - ((char*)slab + SLAB_HEADER_SIZE)) / slab_sizes[slab->size_class];
+}
+
+// puts an object back in its slab, slab_lock must be held. returns false on a double free.
+bool _slab_put(Slab* slab, void* object) {
+    unsigned int c = slab->size_class;
+    unsigned int i = _get_slab_index(slab, object);
+    if (slab->free_bits[i / 64] & (1ULL << (i % 64))) return false;
+    slab->free_bits[i / 64] |= 1ULL << (i % 64);
+    if (!slab->free_objects++) {
+        _slab_link(slab);
+    }
+    slab_free_objects++;
+    slab_free_bytes += slab_sizes[c];
+    // an empty slab is kept only when it is the last one of its class.
+    if (slab->free_objects == slab->capacity && (slab->prev || slab->next)) {
+        _slab_destroy(slab);
+    }
+    return true;
+}
+
+void _slab_flush(ThreadCache* cache, unsigned int c, unsigned int count) {
+    long flushed = 0;
+    pthread_mutex_lock(&slab_lock);
+    while (cache->slab_bins[c] && count--) {
+        void* object = cache->slab_bins[c];
+        cache->slab_bins[c] = *(void**)object;
+        cache->slab_counts[c]--;
+        _slab_put(_get_slab(object), object);
+        flushed++;
+    }
+    pthread_mutex_unlock(&slab_lock);
+    _tcache_add(cache->cached_blocks, -flushed);
+    _tcache_add(cache->cached_bytes, -flushed * (long)slab_sizes[c]);
+    _tcache_publish(cache);
+}
+
+bool _slab_refill(ThreadCache* cache, unsigned int c) {
+    long refilled = 0;
+    pthread_mutex_lock(&slab_lock);
+    while (refilled < TCACHE_BATCH * 2) {
+        Slab* slab = slab_partial[c];
+        if (!slab && (refilled || !(slab = _slab_create(c)))) break;
+        for (unsigned int w = 0; w < SLAB_OBJECTS_MAX / 64 && refilled < TCACHE_BATCH * 2; w++) {
+            while (slab->free_bits[w] && refilled < TCACHE_BATCH * 2) {
+                unsigned int i = w * 64 + __builtin_ctzll(slab->free_bits[w]);
+                slab->free_bits[w] &= slab->free_bits[w] - 1;
+                void* object = (char*)slab + SLAB_HEADER_SIZE + i * slab_sizes[c];
+                *(void**)object = cache->slab_bins[c];
+                cache->slab_bins[c] = object;
+                cache->slab_counts[c]++;
+                slab->free_objects--;
+                refilled++;
+            }
+        }
+        if (!slab->free_objects) {
+            _slab_unlink(slab);
+        }
+    }
+    slab_free_objects -= refilled;
+    slab_free_bytes -= refilled * slab_sizes[c];
+    pthread_mutex_unlock(&slab_lock);
+    _tcache_add(cache->cached_blocks, refilled);
+    _tcache_add(cache->cached_bytes, refilled * (long)slab_sizes[c]);
+    _tcache_publish(cache);
+    return refilled > 0;
+}
+
+void* _slab_alloc(ThreadCache* cache, size_t size) {
+    unsigned int c = _get_slab_class(size);
+    if (!cache->slab_bins[c] && !_slab_refill(cache, c)) return nullptr;
+    void* object = cache->slab_bins[c];
+    cache->slab_bins[c] = *(void**)object;
+    cache->slab_counts[c]--;
+    // slabs are buddy blocks, aligned to their size.
+    Slab* slab = (Slab*)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    unsigned int i = _get_slab_index(slab, object);
+    slab->used_bits[i / 64].fetch_or(1ULL << (i % 64), std::memory_order_relaxed);
+    _tcache_add(cache->cached_blocks, -1);
+    _tcache_add(cache->cached_bytes, -(long)slab_sizes[c]);
+    _tcache_add(cache->active_blocks, 1);
+    _tcache_add(cache->bytes_allocated, slab_sizes[c]);
+    return object;
+}
+
+void _slab_free(ThreadCache* cache, Slab* slab, void* object) {
+    unsigned int c = slab->size_class;
+    // an object freed twice would sit in a cache twice and be handed out twice, the
+    // second free finds its bit already clear and is ignored like one of a heap block.
+    unsigned int i = _get_slab_index(slab, object);
+    uint64_t bit = 1ULL << (i % 64);
+    if (!(slab->used_bits[i / 64].fetch_and(~bit, std::memory_order_relaxed) & bit)) return;
+    if (cache->slab_counts[c] >= TCACHE_MAX_COUNT * 2) {
+        _slab_flush(cache, c, TCACHE_BATCH * 2);
+    }
+    *(void**)object = cache->slab_bins[c];
+    cache->slab_bins[c] = object;
+    cache->slab_counts[c]++;
+    _tcache_add(cache->cached_blocks, 1);
+    _tcache_add(cache->cached_bytes, slab_sizes[c]);
+    _tcache_add(cache->active_blocks, -1);
+    _tcache_add(cache->bytes_allocated, -(long)slab_sizes[c]);
+}
+
+// returns the cached blocks of the given degree to the arenas they belong to.
+void _tcache_flush(ThreadCache* cache, unsigned int d, unsigned int count) {
+    long flushed = 0;
+    Arena* own = _get_arena();
+    Arena* locked = nullptr;
+    while (cache->bins[d] && count--) {
+        MallocMetaData* block = cache->bins[d];
+        cache->bins[d] = *_block_next(block);
+        cache->counts[d]--;
+        _return_block(block, d, own, &locked);
+        flushed++;
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    _tcache_add(cache->cached_blocks, -flushed);
+    _tcache_add(cache->cached_bytes, -flushed * (long)(_get_block_size(d) - BLOCK_HEADER_SIZE));
+    _tcache_publish(cache);
+}
+
+void _trace_flush(ThreadCache* cache, int fd) {
+    if (cache->trace_count) {
+        // a trace with holes is still useful, a failed write goes unreported.
+        ssize_t written = write(fd, cache->trace_buf, cache->trace_count * sizeof(TraceRecord));
+        (void)written;
+    }
+    cache->trace_count = 0;
+}
+
+void _tcache_destroy(void* arg) {
+    ThreadCache* cache = (ThreadCache*)arg;
+    // _trace_stop flushes every listed buffer under heap_lock, this one must not go away
+    // in the middle of it.
+    pthread_mutex_lock(&heap_lock);
+    int fd = trace_fd.load();
+    if (fd >= 0) {
+        _trace_flush(cache, fd);
+    }
+    if (cache->trace_buf) {
+        munmap(cache->trace_buf, TRACE_BUFFER * sizeof(TraceRecord));
+        cache->trace_buf = nullptr;
+        cache->trace_count = 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    for (unsigned int c = 0; c < SLAB_CLASSES; c++) {
+        _slab_flush(cache, c, cache->slab_counts[c]);
+    }
+    for (unsigned int d = 0; d <= TCACHE_MAX_DEG; d++) {
+        _tcache_flush(cache, d, cache->counts[d]);
+    }
+    _tcache_publish(cache);
+    pthread_mutex_lock(&heap_lock);
+    active_blocks_num += cache->active_blocks.load(std::memory_order_relaxed);
+    bytes_allocated += cache->bytes_allocated.load(std::memory_order_relaxed);
+    cache->active_blocks.store(0, std::memory_order_relaxed);
+    cache->bytes_allocated.store(0, std::memory_order_relaxed);
+    // the snapshot totals keep what was published, a reused cache starts from zero.
+    cache->published_blocks = 0;
+    cache->published_bytes = 0;
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        tcache_list = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    cache->next = cache->prev = nullptr;
+    cache->is_registered = false;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void _fork_prepare() {
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&slab_lock);
+    for (unsigned int i = 0; i < arena_num; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&heap_lock);
+    pthread_mutex_lock(&mmap_cache_lock);
+    pthread_mutex_lock(&mapped_lock);
+}
+
+void _fork_parent() {
+    pthread_mutex_unlock(&mapped_lock);
+    pthread_mutex_unlock(&mmap_cache_lock);
+    pthread_mutex_unlock(&heap_lock);
+    for (unsigned int i = 0; i < arena_num; i++) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// the child has a single thread, whatever the others held is consistent again.
+void _fork_child() {
+    pthread_mutex_init(&mapped_lock, nullptr);
+    pthread_mutex_init(&mmap_cache_lock, nullptr);
+    pthread_mutex_init(&heap_lock, nullptr);
+    for (unsigned int i = 0; i < arena_num; i++) {
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+    }
+    pthread_mutex_init(&slab_lock, nullptr);
+    pthread_mutex_init(&prof_lock, nullptr);
+    // the parent keeps writing its own trace, records it had buffered are not ours.
+    int fd = trace_fd.exchange(-1);
+    if (fd >= 0) {
+        close(fd);
+        for (ThreadCache* cache = tcache_list; cache; cache = cache->next) {
+            cache->trace_count = 0;
+        }
+    }
+}
+
+void _tcache_create_key() {
+    cpu_set_t cpus;
+    unsigned int cpu_num = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : MAX_ARENAS;
+    arena_num = std::max(1u, std::min(cpu_num, (unsigned int)MAX_ARENAS));
+    for (unsigned int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+    }
+    pthread_key_create(&tcache_key, _tcache_destroy);
+    pthread_atfork(_fork_prepare, _fork_parent, _fork_child);
+}
+
+// arenas in use, one per cpu the process may run on.
+unsigned int _get_arena_num() {
+    pthread_once(&tcache_key_once, _tcache_create_key);
+    return arena_num;
+}
+
+ThreadCache* _tcache_get() {
+    ThreadCache* cache = &tcache;
+    if (cache->is_registered) return cache;
+
+    pthread_once(&tcache_key_once, _tcache_create_key);
+    pthread_mutex_lock(&heap_lock);
+    cache->is_registered = true;
+    cache->prev = nullptr;
+    cache->next = tcache_list;
+    if (tcache_list) {
+        tcache_list->prev = cache;
+    }
+    tcache_list = cache;
+    pthread_mutex_unlock(&heap_lock);
+    // outside the lock, it may allocate for high key numbers.
+    pthread_setspecific(tcache_key, cache);
+    return cache;
+}
+
+bool _tcache_refill(ThreadCache* cache, unsigned int d) {
+    long refilled = 0;
+    Arena* arena = _get_arena();
+    pthread_mutex_lock(&arena->lock);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        MallocMetaData* block = _alloc_block(arena, d);
+        if (!block) break;
+        _set_block(block, d, BLOCK_CACHED);
+        *_block_next(block) = cache->bins[d];
+        cache->bins[d] = block;
+        cache->counts[d]++;
+        refilled++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    _tcache_add(cache->cached_blocks, refilled);
+    _tcache_add(cache->cached_bytes, refilled * (long)(_get_block_size(d) - BLOCK_HEADER_SIZE));
+    _tcache_publish(cache);
+    return refilled > 0;
+}
+
+size_t _get_map_size(size_t length) {
+    // rounds a mapping up to one of 4 size classes per power of two, so freed
+    // mappings can be reused exactly. untouched tail pages cost no memory.
+    unsigned int p = 63 - __builtin_clzll(length - 1);
+    size_t step = (size_t)1 << (p - 2);
+    return (length + step - 1) & ~(step - 1);
+}
+
+unsigned int _get_map_class(size_t map_size) {
+    unsigned int p = 63 - __builtin_clzll(map_size - 1);
+    return (p - MIN_BLOCK_SHIFT - MAX_DEG) * 4 + (map_size >> (p - 2)) - 5;
+}
+
+long long _now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// puts a new mapping in mapped_table, false when the table cannot grow.
+bool _add_mapping(MallocMetaData* block, size_t map_size) {
+    pthread_mutex_lock(&mapped_lock);
+    size_t slot = mapped_empty;
+    if (slot != MAPPED_NONE) {
+        mapped_empty = mapped_table[slot] >> 1;
+    } else {
+        if (mapped_slots == mapped_capacity) {
+            size_t capacity = mapped_capacity ? mapped_capacity * 2 : MAPPED_TABLE_MIN;
+            void* table = mapped_table
+                ? mremap(mapped_table, mapped_capacity * sizeof(uintptr_t), capacity * sizeof(uintptr_t), MREMAP_MAYMOVE)
+                : mmap(nullptr, capacity * sizeof(uintptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (table == MAP_FAILED) {
+                pthread_mutex_unlock(&mapped_lock);
+                return false;
+            }
+            mapped_table = (uintptr_t*)table;
+            mapped_capacity = capacity;
+        }
+        slot = mapped_slots++;
+    }
+    mapped_table[slot] = (uintptr_t)block;
+    block->degree = slot;
+    pthread_mutex_unlock(&mapped_lock);
+    mapped_blocks_num++;
+    mapped_bytes += map_size;
+    return true;
+}
+
+// takes a mapping out of mapped_table, before it is unmapped.
+void _remove_mapping(MallocMetaData* block) {
+    pthread_mutex_lock(&mapped_lock);
+    mapped_table[block->degree] = mapped_empty << 1 | 1;
+    mapped_empty = block->degree;
+    pthread_mutex_unlock(&mapped_lock);
+    mapped_blocks_num--;
+    mapped_bytes -= block->map_size;
+}
+
+void _mmap_cache_evict(MmapCacheEntry* entry) {
+    mmap_cache_blocks--;
+    mmap_cache_bytes -= entry->block->map_size;
+    _remove_mapping(entry->block);
+    munmap((void*)entry->block, entry->block->map_size);
+    entry->block = nullptr;
+}
+
+// unmaps the cached mappings older than the age limit, mmap_cache_lock must be held.
+void _mmap_cache_sweep(long long now) {
+    mmap_cache_swept_at = now;
+    for (int c = 0; c < MMAP_CACHE_CLASSES && mmap_cache_blocks; c++) {
+        for (int w = 0; w < MMAP_CACHE_WAYS; w++) {
+            MmapCacheEntry* entry = &mmap_cache[c][w];
+            if (entry->block && now - entry->freed_at >= mmap_cache_max_age) {
+                _mmap_cache_evict(entry);
+            }
+        }
+    }
+}
+
+// sweeps the cache once half the age limit passed since the last sweep, so no mapping
+// outlives the limit by more than that. mmap_cache_lock must be held.
+void _mmap_cache_expire(long long now) {
+    if (now - mmap_cache_swept_at >= mmap_cache_max_age / 2) {
+        _mmap_cache_sweep(now);
+    }
+}
+
+// unmaps the oldest cached mapping, mmap_cache_lock must be held.
+void _mmap_cache_evict_oldest() {
+    MmapCacheEntry* oldest = nullptr;
+    for (int c = 0; c < MMAP_CACHE_CLASSES; c++) {
+        for (int w = 0; w < MMAP_CACHE_WAYS; w++) {
+            MmapCacheEntry* entry = &mmap_cache[c][w];
+            if (entry->block && (!oldest || entry->freed_at < oldest->freed_at)) {
+                oldest = entry;
+            }
+        }
+    }
+    if (oldest) {
+        _mmap_cache_evict(oldest);
+    }
+}
+
+MallocMetaData* _mmap_cache_get(size_t map_size, bool is_huge) {
+    unsigned int c = _get_map_class(map_size);
+    if (c >= MMAP_CACHE_CLASSES) return nullptr;
+    MallocMetaData* block = nullptr;
+    long long now = _now_ms();
+    pthread_mutex_lock(&mmap_cache_lock);
+    _mmap_cache_expire(now);
+    MmapCacheEntry* newest = nullptr;
+    for (int w = 0; w < MMAP_CACHE_WAYS; w++) {
+        MmapCacheEntry* entry = &mmap_cache[c][w];
+        if (entry->block && entry->block->map_size == map_size && entry->block->is_huge == is_huge &&
+            (!newest || entry->freed_at > newest->freed_at)) {
+            newest = entry;
+        }
+    }
+    if (newest) {
+        block = newest->block;
+        newest->block = nullptr;
+        mmap_cache_blocks--;
+        mmap_cache_bytes -= map_size;
+        mmap_cache_hits++;
+    } else {
+        mmap_cache_misses++;
+    }
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return block;
+}
+
+bool _mmap_cache_put(MallocMetaData* block) {
+    unsigned int c = _get_map_class(block->map_size);
+    if (c >= MMAP_CACHE_CLASSES || block->map_size > mmap_cache_max_bytes) return false;
+    long long now = _now_ms();
+    pthread_mutex_lock(&mmap_cache_lock);
+    _mmap_cache_expire(now);
+    while (mmap_cache_bytes + block->map_size > mmap_cache_max_bytes) {
+        _mmap_cache_evict_oldest();
+    }
+    MmapCacheEntry* slot = &mmap_cache[c][0];
+    for (int w = 0; w < MMAP_CACHE_WAYS; w++) {
+        MmapCacheEntry* entry = &mmap_cache[c][w];
+        if (!entry->block) {
+            slot = entry;
+            break;
+        }
+        if (entry->freed_at < slot->freed_at) {
+            slot = entry;
+        }
+    }
+    if (slot->block) {
+        _mmap_cache_evict(slot);
+    }
+    slot->block = block;
+    slot->freed_at = now;
+    block->is_cached = true;
+    mmap_cache_blocks++;
+    mmap_cache_bytes += block->map_size;
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return true;
+}
+
+// hands out a mapping of exactly map_size bytes, a cached one when possible.
+MallocMetaData* _map_block(size_t map_size, bool is_huge, bool* is_zeroed = nullptr) {
+    MallocMetaData* block = _mmap_cache_get(map_size, is_huge);
+    if (is_zeroed) {
+        // a cached mapping holds whatever its last owner left in it.
+        *is_zeroed = !block;
+    }
+    if (!block) {
+#if HUGE_PAGES
+        void* p = is_huge ? _map_huge(map_size)
+                          : mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+        void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        block = (MallocMetaData*)p;
+        if (!_add_mapping(block, map_size)) {
+            munmap(p, map_size);
+            return nullptr;
+        }
+    }
+    block->map_size = map_size;
+    block->is_mmap = true;
+    block->is_cached = false;
+    block->is_huge = is_huge;
+    block->magic = MMAP_MAGIC ^ (unsigned int)((uintptr_t)block >> 12);
+    block->next = nullptr;
+    return block;
+}
+
+void _unmap_block(MallocMetaData* block) {
+    if (!_mmap_cache_put(block)) {
+        _remove_mapping(block);
+        munmap((void*)block, block->map_size);
+    }
+}
+
+// grows an mmap'd block to fit size, the kernel moves the pages instead of copying them.
+MallocMetaData* _remap_block(MallocMetaData* block, size_t size) {
+    size_t map_size = _get_map_size(size + sizeof(MallocMetaData));
+    if (block->is_huge) {
+        map_size = (map_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+    // under mapped_lock, a walk of the mappings must not read the old address.
+    pthread_mutex_lock(&mapped_lock);
+    size_t old_size = block->map_size;
+    void* p = mremap((void*)block, old_size, map_size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+        pthread_mutex_unlock(&mapped_lock);
+        return nullptr;
+    }
+    mapped_bytes += map_size - old_size;
+    block = (MallocMetaData*)p;
+    block->map_size = map_size;
+    mapped_table[block->degree] = (uintptr_t)block;
+    pthread_mutex_unlock(&mapped_lock);
+    // the magic holds the page number, a moved block needs a new one to stay ours.
+    block->magic = MMAP_MAGIC ^ (unsigned int)((uintptr_t)block >> 12);
+    return block;
+}
+
+bool _is_sampled(MallocMetaData* block) {
+#if COMPACT_META
+    if (!_is_mapped(block)) return _get_block_state(block) & BLOCK_SAMPLED;
+#endif
+    return block->is_sampled;
+}
+
+void _set_sampled(MallocMetaData* block, bool is_sampled) {
+#if COMPACT_META
+    if (!_is_mapped(block)) {
+        _set_block(block, _get_block_degree(block), is_sampled ? BLOCK_ALLOCATED | BLOCK_SAMPLED : BLOCK_ALLOCATED);
+        return;
+    }
+#endif
+    block->is_sampled = is_sampled;
+}
+
+size_t _prof_slot(MallocMetaData* block) {
+    return (size_t)(((uintptr_t)block >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (PROF_SAMPLES - 1);
+}
+
+// drops a sampled block from the live profile as it is freed or moved.
+void _prof_forget(MallocMetaData* block) {
+    pthread_mutex_lock(&prof_lock);
+    size_t i = _prof_slot(block);
+    while (prof_samples[i].block && prof_samples[i].block != block) {
+        i = (i + 1) & (PROF_SAMPLES - 1);
+    }
+    if (prof_samples[i].block) {
+        prof_samples[i].stack->live_count--;
+        prof_samples[i].stack->live_bytes -= prof_samples[i].size;
+        prof_sample_num--;
+        // the entries after it that probed past the slot move back, so none is cut off.
+        for (size_t j = (i + 1) & (PROF_SAMPLES - 1); prof_samples[j].block; j = (j + 1) & (PROF_SAMPLES - 1)) {
+            size_t home = _prof_slot(prof_samples[j].block);
+            if (((j - home) & (PROF_SAMPLES - 1)) >= ((j - i) & (PROF_SAMPLES - 1))) {
+                prof_samples[i] = prof_samples[j];
+                i = j;
+            }
+        }
+        prof_samples[i].block = nullptr;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    _set_sampled(block, false);
+}
+
+// zero_from, when given, is set to the address from which the payload is known to
+// read as zeroes, and left alone when nothing is known.
+void* _smalloc(size_t size, char** zero_from = nullptr) {
+
+    if (size == 0 || size > 100000000) return nullptr;
+
+    ThreadCache* cache = _tcache_get();
+    if (size <= SLAB_MAX_SIZE) {
+        return _slab_alloc(cache, size);
+    }
+
+    MallocMetaData* current;
+    bool is_zeroed = false;
+    if (size + BLOCK_HEADER_SIZE > _get_block_size(MAX_DEG)) {
+        size_t total_size = _get_map_size(size + sizeof(MallocMetaData));
+        bool is_huge = HUGE_PAGES && size >= 1 << 22;
+        if (is_huge) {
+            total_size = (total_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        }
+        current = _map_block(total_size, is_huge, &is_zeroed);
+        if (!current) {
+            return nullptr;
+        }
+        current->size = size;
+        current->is_free = false;
+        _tcache_add(cache->active_blocks, 1);
+        _tcache_add(cache->bytes_allocated, size);
+        _tcache_publish(cache);
+        if (zero_from && is_zeroed) {
+            *zero_from = (char*)current + sizeof(MallocMetaData);
+        }
+        return (void*)((char*)current + sizeof(MallocMetaData));
+    }
+
+    unsigned int d = _get_degree(size);
+    if (d <= TCACHE_MAX_DEG) {
+        if (!cache->bins[d] && !_tcache_refill(cache, d)) return nullptr;
+        current = cache->bins[d];
+        cache->bins[d] = *_block_next(current);
+        cache->counts[d]--;
+        _set_block(current, d, BLOCK_ALLOCATED);
+        _tcache_add(cache->cached_blocks, -1);
+        _tcache_add(cache->cached_bytes, -(long)(_get_block_size(d) - BLOCK_HEADER_SIZE));
+    } else {
+        Arena* arena = _get_arena();
+        pthread_mutex_lock(&arena->lock);
+        current = _alloc_block(arena, d, &is_zeroed);
+        pthread_mutex_unlock(&arena->lock);
+        if (!current) return nullptr;
+        if (zero_from && is_zeroed) {
+            *zero_from = (char*)current + getpagesize();
+        }
+    }
+    _tcache_add(cache->active_blocks, 1);
+#if !COMPACT_META
+    current->size = size;
+#endif
+    _tcache_add(cache->bytes_allocated, _counted_bytes(current, d));
+    if (d > TCACHE_MAX_DEG) {
+        _tcache_publish(cache);
+    }
+    return (void*)((char*)current + BLOCK_HEADER_SIZE);
+}
+
+void* _scalloc(size_t num, size_t size) {
+
+    if (num == 0 || size == 0) return nullptr;
+
+    if (num > __SIZE_MAX__ / size) return nullptr;
+
+    if (num * size > 100000000) return nullptr;
+
+    size_t total_size = num * size;
+
+#if HUGE_PAGES
+    if (total_size + sizeof(MallocMetaData) >= HUGE_PAGE_SIZE) {
+        size_t map_size = _get_map_size(total_size + sizeof(MallocMetaData));
+        map_size = (map_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        bool is_zeroed;
+        MallocMetaData* current = _map_block(map_size, true, &is_zeroed);
+        if (!current) {
+            return nullptr;
+        }
+
+        ThreadCache* cache = _tcache_get();
+        _tcache_add(cache->active_blocks, 1);
+        _tcache_add(cache->bytes_allocated, num * size);
+        current->size = size * num;
+        current->is_free = false;
+        if (!is_zeroed) {
+            memset((char*)current + sizeof(MallocMetaData), 0, total_size);
+        }
+        return (void*)((char*)current + sizeof(MallocMetaData));
+    }
+#endif
+
+    // only what may have been used before is cleared, pages that are still zero
+    // are not touched until the caller writes them.
+    char* zero_from = nullptr;
+    char* ptr = (char*)_smalloc(total_size, &zero_from);
+    if (!ptr) return nullptr;
+
+    size_t dirty = total_size;
+    if (zero_from) {
+        dirty = zero_from > ptr ? std::min((size_t)(zero_from - ptr), total_size) : 0;
+    }
+    memset(ptr, 0, dirty);
+
+    return ptr;
+}
+
+// parks a freed block of a cached degree in the thread cache.
+void _cache_block(ThreadCache* cache, MallocMetaData* block, unsigned int degree) {
+    if (cache->counts[degree] >= TCACHE_MAX_COUNT) {
+        _tcache_flush(cache, degree, TCACHE_BATCH);
+    }
+    _set_block(block, degree, BLOCK_CACHED);
+    *_block_next(block) = cache->bins[degree];
+    cache->bins[degree] = block;
+    cache->counts[degree]++;
+    _tcache_add(cache->cached_blocks, 1);
+    _tcache_add(cache->cached_bytes, _get_block_size(degree) - BLOCK_HEADER_SIZE);
+}
+
+void _sfree(void* p) {
+    if (!p) return;
+
+    Slab* slab = _get_slab(p);
+    if (slab) {
+        _slab_free(_tcache_get(), slab, p);
+        return;
+    }
+
+    // an aligned payload, the block it was carved from goes back.
+    MallocMetaData* block = _get_block(p);
+
+    ThreadCache* cache = _tcache_get();
+    if (_is_mapped(block)){
+        if (block->is_free || block->is_cached) return;
+        if (block->is_sampled) {
+            _prof_forget(block);
+        }
+        _tcache_add(cache->active_blocks, -1);
+        _tcache_add(cache->bytes_allocated, -(long)block->size);
+        _tcache_publish(cache);
+        _unmap_block(block);
+        return;
+    }
+
+    unsigned char state = _get_block_state(block);
+    if (state != BLOCK_ALLOCATED) {
+        if (state != (BLOCK_ALLOCATED | BLOCK_SAMPLED)) return;
+        _prof_forget(block);
+    }
+    unsigned int old_deg = _get_block_degree(block);
+    long old_size = _counted_bytes(block, old_deg);
+    if (old_deg <= TCACHE_MAX_DEG) {
+        _cache_block(cache, block, old_deg);
+    }
+    else{
+        Arena* locked = nullptr;
+        _return_block(block, old_deg, _get_arena(), &locked);
+        if (locked) {
+            pthread_mutex_unlock(&locked->lock);
+        }
+    }
+    _tcache_add(cache->active_blocks, -1);
+    _tcache_add(cache->bytes_allocated, -old_size);
+    if (old_deg > TCACHE_MAX_DEG) {
+        _tcache_publish(cache);
+    }
+}
+
+
+void _sfree_sized(void* p, size_t size) {
+/*
+ * sfree for a caller that passes back the size it asked smalloc, scalloc or srealloc
+ * for. a block of the degree that size maps to is recognised by its state alone and
+ * goes straight to the thread cache, the slab map and the stub of an aligned payload
+ * are not looked at. anything else, a slab object, a mapping, a bigger block or one
+ * that was sampled or shrunk in place, takes the sfree path.
+ */
+    unsigned int degree = _get_degree(size);
+    if (size <= SLAB_MAX_SIZE || degree > TCACHE_MAX_DEG || !_in_heap(p)) {
+        _sfree(p);
+        return;
+    }
+    MallocMetaData* block = (MallocMetaData*)((char*)p - BLOCK_HEADER_SIZE);
+    if (_get_block_state(block) != BLOCK_ALLOCATED || _get_block_degree(block) != degree) {
+        _sfree(p);
+        return;
+    }
+    long old_size = _counted_bytes(block, degree);
+    ThreadCache* cache = _tcache_get();
+    _cache_block(cache, block, degree);
+    _tcache_add(cache->active_blocks, -1);
+    _tcache_add(cache->bytes_allocated, -old_size);
+}
+
+
+// the bytes p, from any of the allocation calls, can hold.
+size_t _usable_size(void* p) {
+    Slab* slab = _get_slab(p);
+    if (slab) return slab_sizes[slab->size_class];
+    MallocMetaData* block = _get_block(p);
+    return _get_block_span(block) - ((char*)p - (char*)block);
+}
+
+void* _srealloc(void* oldp, size_t size) {
+
+    if(size == 0 || size > 100000000) return nullptr;
+
+    size_t old_payload;
+    Slab* old_slab = oldp ? _get_slab(oldp) : nullptr;
+    if (old_slab) {
+        old_payload = slab_sizes[old_slab->size_class];
+        if(size <= old_payload) return oldp;
+    }
+    else if(oldp){
+        MallocMetaData* old_m = _get_block(oldp);
+        old_payload = _get_block_span(old_m) - ((char*)oldp - (char*)old_m);
+        if(size <= old_payload) return oldp;
+        if (_is_sampled(old_m)) {
+            // it may move or grow below, what comes out is sampled afresh if at all.
+            _prof_forget(old_m);
+        }
+        if (_is_mapped(old_m)) {
+            // only a payload right after its header is remapped, moving an aligned one
+            // drops its alignment, as realloc does.
+            MallocMetaData* block = nullptr;
+            if (oldp == (char*)old_m + sizeof(MallocMetaData)) {
+                block = _remap_block(old_m, size);
+            }
+            if (block) {
+                _tcache_add(_tcache_get()->bytes_allocated, (long)size - block->size);
+                block->size = size;
+                return (void*)((char*)block + sizeof(MallocMetaData));
+            }
+        } else if (oldp == (char*)old_m + BLOCK_HEADER_SIZE) {
+            long old_size = _counted_bytes(old_m, _get_block_degree(old_m));
+            // grow in place when the higher buddies are free, no copy is needed.
+            Arena* arena = _get_block_arena(old_m);
+            pthread_mutex_lock(&arena->lock);
+            bool is_grown = _grow_block(old_m, _get_degree(size));
+            pthread_mutex_unlock(&arena->lock);
+            if (is_grown) {
+#if !COMPACT_META
+                old_m->size = size;
+#endif
+                _tcache_add(_tcache_get()->bytes_allocated, _counted_bytes(old_m, _get_block_degree(old_m)) - old_size);
+                return oldp;
+            }
+        }
+    }
+    char* new_data = (char*)_smalloc(size);
+    if(!new_data) return nullptr;
+
+    if(oldp)
+        std::memmove(new_data, oldp, std::min(old_payload, size));
+
+    _sfree(oldp);
+    return new_data;
+}
+
+
+void* _smemalign(size_t alignment, size_t size) {
+/*
+ * returns size bytes aligned to alignment, a power of two. a buddy block is aligned
+ * to its own size, so the payload goes alignment bytes into a block big enough for
+ * both and a stub header right before it leads sfree back to the block.
+ */
+    if (!alignment || (alignment & (alignment - 1))) return nullptr;
+    if (size == 0 || size > 100000000) return nullptr;
+
+    // only the 8 byte slab objects are less than 16 byte aligned, every header ends on a
+    // 32 byte boundary.
+    if (alignment <= 8) return _smalloc(size);
+    if (alignment <= 16) return _smalloc(size > 8 ? size : 16);
+    if (alignment <= sizeof(MallocMetaData)) return _smalloc(size > SLAB_MAX_SIZE ? size : SLAB_MAX_SIZE + 1);
+#if COMPACT_META
+    // without a header the payload is the block itself, one as big as the alignment needs no stub.
+    if (size <= _get_block_size(MAX_DEG) && alignment <= _get_block_size(MAX_DEG)) {
+        return _smalloc(std::max(std::max(size, alignment), (size_t)SLAB_MAX_SIZE + 1));
+    }
+#endif
+
+    size_t request = size + alignment;
+    if (request + BLOCK_HEADER_SIZE > _get_block_size(MAX_DEG) && alignment > 4096) {
+        request += alignment;  // mappings are only page aligned
+    }
+    if (request > 100000000) return nullptr;
+
+    char* base = (char*)_smalloc(request);
+    if (!base) return nullptr;
+    char* p = (char*)(((uintptr_t)base + sizeof(MallocMetaData) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    MallocMetaData* stub = (MallocMetaData*)(p - sizeof(MallocMetaData));
+    stub->degree = ALIGNED_DEG;
+    stub->next = (MallocMetaData*)(base - sizeof(MallocMetaData));
+    stub->is_mmap = false;
+    stub->is_free = false;
+    stub->is_cached = false;
+    stub->magic = ALIGNED_MAGIC ^ (unsigned int)((uintptr_t)stub >> 12);
+    return p;
+}
+
+size_t _smalloc_batch(size_t size, size_t n, void** out) {
+/*
+ * allocates n blocks of size bytes into out and returns how many it got, fewer than
+ * n only when memory runs out. the thread cache is drained first, the rest is cut
+ * from as few free buddy blocks as possible under a single lock.
+ */
+    if (size == 0 || size > 100000000) return 0;
+
+    ThreadCache* cache = _tcache_get();
+    size_t count = 0;
+    if (size <= SLAB_MAX_SIZE || size + BLOCK_HEADER_SIZE > _get_block_size(MAX_DEG)) {
+        // slab objects already come from a per thread list, mappings one syscall each.
+        while (count < n && (out[count] = _smalloc(size))) {
+            count++;
+        }
+        return count;
+    }
+
+    unsigned int d = _get_degree(size);
+    if (d <= TCACHE_MAX_DEG) {
+        while (count < n && cache->bins[d]) {
+            MallocMetaData* block = cache->bins[d];
+            cache->bins[d] = *_block_next(block);
+            cache->counts[d]--;
+            _set_block(block, d, BLOCK_ALLOCATED);
+            out[count++] = (char*)block + BLOCK_HEADER_SIZE;
+        }
+        _tcache_add(cache->cached_blocks, -(long)count);
+        _tcache_add(cache->cached_bytes, -(long)(count * (_get_block_size(d) - BLOCK_HEADER_SIZE)));
+    }
+    if (count < n) {
+        Arena* arena = _get_arena();
+        pthread_mutex_lock(&arena->lock);
+        size_t cut;
+        while (count < n && (cut = _alloc_run(arena, d, n - count, out + count))) {
+            count += cut;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    _tcache_add(cache->active_blocks, count);
+    long bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        MallocMetaData* block = (MallocMetaData*)((char*)out[i] - BLOCK_HEADER_SIZE);
+#if !COMPACT_META
+        block->size = size;
+#endif
+        bytes += _counted_bytes(block, d);
+    }
+    _tcache_add(cache->bytes_allocated, bytes);
+    _tcache_publish(cache);
+    return count;
+}
+
+// gives a chunk of heap blocks of sfree_batch back to the free maps of their arenas.
+void _free_blocks(MallocMetaData** blocks, size_t count) {
+    Arena* own = _get_arena();
+    Arena* locked = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        _return_block(blocks[i], _get_block_degree(blocks[i]), own, &locked);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+void _sfree_batch(void** ptrs, size_t n) {
+/*
+ * frees the n pointers of ptrs, skipping nullptr entries. blocks the thread cache has
+ * room for go there as with sfree, the other heap blocks are coalesced FREE_BATCH_CHUNK
+ * at a time under a single lock.
+ */
+    ThreadCache* cache = _tcache_get();
+    MallocMetaData* blocks[FREE_BATCH_CHUNK];
+    size_t count = 0;
+    long freed = 0;
+    long freed_bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        void* p = ptrs[i];
+        if (!p) continue;
+        if (_get_slab(p)) {
+            _sfree(p);
+            continue;
+        }
+        MallocMetaData* block = _get_block(p);
+        if (_is_mapped(block)) {
+            _sfree(p);
+            continue;
+        }
+        unsigned char state = _get_block_state(block);
+        if (state != BLOCK_ALLOCATED) {
+            if (state == (BLOCK_ALLOCATED | BLOCK_SAMPLED)) {
+                _sfree(p);
+            }
+            continue;
+        }
+        unsigned int d = _get_block_degree(block);
+        if (d <= TCACHE_MAX_DEG && cache->counts[d] < TCACHE_MAX_COUNT) {
+            _sfree(p);
+            continue;
+        }
+        // marked right away, so the same pointer twice in ptrs is freed once.
+        _set_block(block, d, BLOCK_FREE);
+        blocks[count++] = block;
+        freed++;
+        freed_bytes += _counted_bytes(block, d);
+        if (count == FREE_BATCH_CHUNK) {
+            _free_blocks(blocks, count);
+            count = 0;
+        }
+    }
+    if (count) {
+        _free_blocks(blocks, count);
+    }
+    _tcache_add(cache->active_blocks, -freed);
+    _tcache_add(cache->bytes_allocated, -freed_bytes);
+    _tcache_publish(cache);
+}
+
+void _trace_append(ThreadCache* cache, uint64_t time_ns, unsigned char op, void* p, size_t size,
+                   unsigned char align_shift) {
+    TraceRecord* record = &cache->trace_buf[cache->trace_count++];
+    record->time_ns = time_ns;
+    record->ptr = (uintptr_t)p;
+    record->size = (uint32_t)size;
+    record->thread = cache->trace_thread;
+    record->op = op;
+    record->align_shift = align_shift;
+}
+
+void _trace(unsigned char op, void* p, size_t size, unsigned char align_shift, void* oldp) {
+    ThreadCache* cache = _tcache_get();
+    // pairs with _trace_stop, either it sees the flag or this sees the closed fd.
+    cache->is_tracing.store(true);
+    int fd = trace_fd.load();
+    if (fd >= 0) {
+        if (!cache->trace_buf) {
+            void* buf = mmap(nullptr, TRACE_BUFFER * sizeof(TraceRecord), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            cache->trace_buf = buf == MAP_FAILED ? nullptr : (TraceRecord*)buf;
+            cache->trace_thread = (uint16_t)syscall(SYS_gettid);
+        }
+        if (cache->trace_buf) {
+            // both records of a realloc go out in the same write.
+            if (cache->trace_count + 2 > TRACE_BUFFER) {
+                _trace_flush(cache, fd);
+            }
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+            if (op == TRACE_REALLOC) {
+                _trace_append(cache, time_ns, TRACE_REALLOC_FROM, oldp, 0, 0);
+            }
+            _trace_append(cache, time_ns, op, p, size, align_shift);
+        }
+    }
+    cache->is_tracing.store(false, std::memory_order_release);
+}
+
+// bytes to the next sample, drawn from an exponential distribution so that every byte
+// allocated has the same chance to be the one sampled.
+long _prof_next(ThreadCache* cache, size_t interval) {
+    uint64_t x = cache->prof_seed ? cache->prof_seed : ((uintptr_t)cache * 0x9e3779b97f4a7c15ULL) | 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cache->prof_seed = x;
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long)(-std::log(u) * interval) + 1;
+}
+
+bool _prof_dump(const char* path);
+
+void* _prof_sample(void* p, size_t size) {
+/*
+ * called when the allocation of p runs the thread's countdown out, it records p and
+ * the stack that allocated it while the profiler is on. a slab object has no state
+ * to mark, a sampled one is moved to a heap block of its own first.
+ */
+    ThreadCache* cache = &tcache;
+    size_t interval = prof_interval.load(std::memory_order_relaxed);
+    if (!interval) {
+        cache->prof_countdown = PROF_RECHECK;
+        return p;
+    }
+    cache->prof_countdown = _prof_next(cache, interval);
+    if (prof_dump_pending.load(std::memory_order_relaxed) && prof_dump_pending.exchange(false)) {
+        char path[PATH_MAX + 32];
+        pthread_mutex_lock(&prof_lock);
+        snprintf(path, sizeof(path), "%s.%u.heap", prof_dump_path, prof_dump_num++);
+        pthread_mutex_unlock(&prof_lock);
+        _prof_dump(path);
+    }
+    if (_get_slab(p)) {
+        void* moved = _smalloc(SLAB_MAX_SIZE + 1);
+        if (!moved) return p;
+        memcpy(moved, p, size);
+        _sfree(p);
+        p = moved;
+    }
+    MallocMetaData* block = _get_block(p);
+    if (_is_sampled(block)) return p;
+
+    void* frames[PROF_DEPTH + 1];
+    int depth = backtrace(frames, PROF_DEPTH + 1) - 1;  // this function left out
+    if (depth <= 0) return p;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 1; i <= depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+    }
+    pthread_mutex_lock(&prof_lock);
+    size_t s = hash & (PROF_STACKS - 1);
+    size_t probes = 0;
+    while (prof_stacks[s].depth && probes < PROF_STACKS &&
+           (prof_stacks[s].depth != (unsigned int)depth ||
+            memcmp(prof_stacks[s].frames, frames + 1, depth * sizeof(void*)))) {
+        s = (s + 1) & (PROF_STACKS - 1);
+        probes++;
+    }
+    // with either table full the sample is lost.
+    if (probes < PROF_STACKS && prof_sample_num < PROF_SAMPLES / 4 * 3) {
+        ProfStack* stack = &prof_stacks[s];
+        if (!stack->depth) {
+            memcpy(stack->frames, frames + 1, depth * sizeof(void*));
+            stack->depth = depth;
+        }
+        size_t i = _prof_slot(block);
+        while (prof_samples[i].block) {
+            i = (i + 1) & (PROF_SAMPLES - 1);
+        }
+        prof_samples[i] = {block, size, stack};
+        prof_sample_num++;
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->total_count++;
+        stack->total_bytes += size;
+        _set_sampled(block, true);
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return p;
+}
+
+void _prof_signal(int) {
+    prof_dump_pending.store(true, std::memory_order_relaxed);
+}
+
+void* smalloc(size_t size) {
+    void* p = _smalloc(size);
+    if (p && (tcache.prof_countdown -= size) < 0) {
+        p = _prof_sample(p, size);
+    }
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(TRACE_MALLOC, p, size, 0, nullptr);
+    }
+    return p;
+}
+
+void* scalloc(size_t num, size_t size) {
+    void* p = _scalloc(num, size);
+    if (p && (tcache.prof_countdown -= num * size) < 0) {
+        p = _prof_sample(p, num * size);
+    }
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(TRACE_CALLOC, p, num * size, 0, nullptr);
+    }
+    return p;
+}
+
+void sfree(void* p) {
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(TRACE_FREE, p, 0, 0, nullptr);
+    }
+    _sfree(p);
+}
+
+// sfree for a block of a known size, p must come from smalloc, scalloc or srealloc with
+// that size.
+void sfree_sized(void* p, size_t size) {
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(TRACE_FREE, p, 0, 0, nullptr);
+    }
+    _sfree_sized(p, size);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    // a block that stays where it is counts for what it grew by, if anything.
+    size_t old_size = oldp ? _usable_size(oldp) : 0;
+    void* p = _srealloc(oldp, size);
+    size_t allocated = p != oldp ? size : size > old_size ? size - old_size : 0;
+    if (p && (tcache.prof_countdown -= allocated) < 0) {
+        p = _prof_sample(p, size);
+    }
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(oldp ? TRACE_REALLOC : TRACE_MALLOC, p, size, 0, oldp);
+    }
+    return p;
+}
+
+void* smemalign(size_t alignment, size_t size) {
+    void* p = _smemalign(alignment, size);
+    if (p && (tcache.prof_countdown -= size) < 0) {
+        p = _prof_sample(p, size);
+    }
+    if (p && trace_fd.load(std::memory_order_relaxed) >= 0) {
+        _trace(TRACE_MEMALIGN, p, size, __builtin_ctzll(alignment), nullptr);
+    }
+    return p;
+}
+
+void* saligned_alloc(size_t alignment, size_t size) {
+    return smemalign(alignment, size);
+}
+
+size_t smalloc_batch(size_t size, size_t n, void** out) {
+    size_t count = _smalloc_batch(size, n, out);
+    if ((tcache.prof_countdown -= count * size) < 0) {
+        tcache.prof_countdown += count * size;
+        for (size_t i = 0; i < count; i++) {
+            if ((tcache.prof_countdown -= size) < 0) {
+                out[i] = _prof_sample(out[i], size);
+            }
+        }
+    }
+    if (trace_fd.load(std::memory_order_relaxed) >= 0) {
+        for (size_t i = 0; i < count; i++) {
+            _trace(TRACE_MALLOC, out[i], size, 0, nullptr);
+        }
+    }
+    return count;
+}
+
+void sfree_batch(void** ptrs, size_t n) {
+    if (trace_fd.load(std::memory_order_relaxed) >= 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i]) {
+                _trace(TRACE_FREE, ptrs[i], 0, 0, nullptr);
+            }
+        }
+    }
+    _sfree_batch(ptrs, n);
+}
+
+Region* sregion_create(size_t chunk_size) {
+/*
+ * makes a region whose chunks come from the heap, chunk_size bytes at a time or
+ * REGION_CHUNK_SIZE when 0. above the largest block the chunks are mappings. a
+ * region belongs to one thread at a time, nothing in it is locked.
+ */
+    if (chunk_size > 100000000 - sizeof(RegionChunk)) return nullptr;
+    Region* region = (Region*)_smalloc(sizeof(Region));
+    if (!region) return nullptr;
+    region->chunks = nullptr;
+    region->current = nullptr;
+    region->top = nullptr;
+    region->end = nullptr;
+    region->chunk_size = chunk_size ? chunk_size : REGION_CHUNK_SIZE;
+    return region;
+}
+
+// moves the region to the next chunk that holds size bytes, allocating one at the end
+// of the list if none does. chunks passed over stay unused until the next reset.
+void* _region_grow(Region* region, size_t size) {
+    RegionChunk** link = region->current ? &region->current->next : &region->chunks;
+    while (*link && (*link)->size < size) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        size_t chunk_size = std::max(region->chunk_size, size);
+        RegionChunk* chunk = (RegionChunk*)_smalloc(sizeof(RegionChunk) + chunk_size);
+        if (!chunk) return nullptr;
+        chunk->next = nullptr;
+        chunk->size = chunk_size;
+        *link = chunk;
+    }
+    region->current = *link;
+    char* p = (char*)(region->current + 1);
+    region->top = p + size;
+    region->end = p + region->current->size;
+    return p;
+}
+
+void* sregion_alloc(Region* region, size_t size) {
+    if (size == 0 || size > 100000000) return nullptr;
+    size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    if (size <= (size_t)(region->end - region->top)) {
+        void* p = region->top;
+        region->top += size;
+        return p;
+    }
+    return _region_grow(region, size);
+}
+
+// releases everything allocated from the region at once, its chunks are kept for reuse.
+void sregion_reset(Region* region) {
+    region->current = region->chunks;
+    region->top = region->chunks ? (char*)(region->chunks + 1) : nullptr;
+    region->end = region->chunks ? region->top + region->chunks->size : nullptr;
+}
+
+void sregion_destroy(Region* region) {
+    if (!region) return;
+    RegionChunk* chunk = region->chunks;
+    while (chunk) {
+        RegionChunk* next = chunk->next;
+        _sfree(chunk);
+        chunk = next;
+    }
+    _sfree(region);
+}
+
+// sums a counter over every live thread cache, heap_lock must be held.
+long _tcache_sum(std::atomic<long> ThreadCache::* counter) {
+    long count = 0;
+    for (ThreadCache* cache = tcache_list; cache; cache = cache->next) {
+        count += (cache->*counter).load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+size_t _num_free_blocks() {
+    size_t count = 0;
+    unsigned int n = _get_arena_num();
+    for (unsigned int a = 0; a < n; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+        _drain_remote_frees(&arenas[a]);
+        for(int i = 0; i <= MAX_DEG; i++) {
+            count += arenas[a].free_count[i];
+        }
+        for (int i = 0; i < MAX_DEG; i++) {
+            count += arenas[a].deferred_count[i];
+        }
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+    pthread_mutex_lock(&heap_lock);
+    count += _tcache_sum(&ThreadCache::cached_blocks);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_lock(&slab_lock);
+    count += slab_free_objects;
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_lock(&mmap_cache_lock);
+    count += mmap_cache_blocks;
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return count;
+}
+
+size_t _num_free_bytes() {
+    size_t count = 0;
+    unsigned int n = _get_arena_num();
+    for (unsigned int a = 0; a < n; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+        _drain_remote_frees(&arenas[a]);
+        for (int i = 0; i <= MAX_DEG; i++) {
+            count += arenas[a].free_count[i] * (_get_block_size(i) - BLOCK_HEADER_SIZE);
+        }
+        for (int i = 0; i < MAX_DEG; i++) {
+            count += arenas[a].deferred_count[i] * (_get_block_size(i) - BLOCK_HEADER_SIZE);
+        }
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+    pthread_mutex_lock(&heap_lock);
+    count += _tcache_sum(&ThreadCache::cached_bytes);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_lock(&slab_lock);
+    count += slab_free_bytes;
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_lock(&mmap_cache_lock);
+    count += mmap_cache_bytes - mmap_cache_blocks * sizeof(MallocMetaData);
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return count;
+}
+
+size_t _num_allocated_blocks() {
+    pthread_mutex_lock(&heap_lock);
+    long active = active_blocks_num + _tcache_sum(&ThreadCache::active_blocks);
+    pthread_mutex_unlock(&heap_lock);
+    return active + _num_free_blocks();
+}
+
+size_t _num_allocated_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    long allocated = bytes_allocated + _tcache_sum(&ThreadCache::bytes_allocated);
+    pthread_mutex_unlock(&heap_lock);
+    return allocated + _num_free_bytes();
+}
+
+bool _trace_start(const char* path) {
+/*
+ * starts recording every smalloc, scalloc, srealloc, smemalign and sfree of every
+ * thread to a new trace file at path. each thread writes its records in batches,
+ * so the file is only ordered by time within a thread.
+ */
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    TraceHeader header = {TRACE_MAGIC, sizeof(TraceRecord)};
+    int expected = -1;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || !trace_fd.compare_exchange_strong(expected, fd)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool _prof_start(size_t sample_bytes) {
+/*
+ * starts sampling about one allocation per sample_bytes allocated, recording the
+ * stack of each sampled one. threads that allocated while the profiler was off
+ * notice within PROF_RECHECK bytes.
+ */
+    if (!sample_bytes) return false;
+    // the first backtrace loads the unwinder, which allocates, so not from a sample.
+    void* frame;
+    backtrace(&frame, 1);
+    pthread_mutex_lock(&prof_lock);
+    prof_rate = sample_bytes;
+    pthread_mutex_unlock(&prof_lock);
+    prof_interval.store(sample_bytes, std::memory_order_relaxed);
+    return true;
+}
+
+// stops sampling, the blocks already sampled stay in the profile until they are freed.
+void _prof_stop() {
+    prof_interval.store(0, std::memory_order_relaxed);
+}
+
+bool _prof_write(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        buf += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool _prof_dump(const char* path) {
+/*
+ * writes the profile to path in the legacy heap profile format pprof reads: the live
+ * and the cumulative sampled objects and bytes of every stack, then the mappings of
+ * the process to symbolize them. pprof scales the samples back up by the interval in
+ * the header, e.g. pprof --text ./program path.
+ */
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    char buf[4096];
+    size_t len = 0;
+    bool is_written = true;
+    pthread_mutex_lock(&prof_lock);
+    size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+    for (size_t s = 0; s < PROF_STACKS; s++) {
+        live_count += prof_stacks[s].live_count;
+        live_bytes += prof_stacks[s].live_bytes;
+        total_count += prof_stacks[s].total_count;
+        total_bytes += prof_stacks[s].total_bytes;
+    }
+    len = snprintf(buf, sizeof(buf), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                   live_count, live_bytes, total_count, total_bytes, prof_rate);
+    for (size_t s = 0; s < PROF_STACKS; s++) {
+        ProfStack* stack = &prof_stacks[s];
+        if (!stack->depth) continue;
+        if (len + 96 + PROF_DEPTH * 20 > sizeof(buf)) {
+            is_written &= _prof_write(fd, buf, len);
+            len = 0;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "%zu: %zu [%zu: %zu] @",
+                        stack->live_count, stack->live_bytes, stack->total_count, stack->total_bytes);
+        for (unsigned int i = 0; i < stack->depth; i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, " %p", stack->frames[i]);
+        }
+        buf[len++] = '\n';
+    }
+    pthread_mutex_unlock(&prof_lock);
+    static const char maps_title[] = "\nMAPPED_LIBRARIES:\n";
+    is_written &= _prof_write(fd, buf, len) && _prof_write(fd, maps_title, sizeof(maps_title) - 1);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+    while (maps >= 0 && (n = read(maps, buf, sizeof(buf))) > 0) {
+        is_written &= _prof_write(fd, buf, n);
+    }
+    if (maps >= 0) {
+        close(maps);
+    }
+    return close(fd) == 0 && is_written && maps >= 0;
+}
+
+bool _prof_dump_on_signal(int signo, const char* path) {
+/*
+ * makes signo ask for a dump to path.<n>.heap, n counting from 0. the handler only
+ * raises a flag, the next sampled allocation of any thread writes the dump.
+ */
+    if (strlen(path) >= PATH_MAX) return false;
+    pthread_mutex_lock(&prof_lock);
+    strcpy(prof_dump_path, path);
+    pthread_mutex_unlock(&prof_lock);
+    struct sigaction action = {};
+    action.sa_handler = _prof_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signo, &action, nullptr) == 0;
+}
+
+void _trace_stop() {
+    int fd = trace_fd.exchange(-1);
+    if (fd < 0) return;
+    pthread_mutex_lock(&heap_lock);
+    for (ThreadCache* cache = tcache_list; cache; cache = cache->next) {
+        while (cache->is_tracing.load()) {
+            sched_yield();
+        }
+        _trace_flush(cache, fd);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    close(fd);
+}
+
+size_t _trim() {
+/*
+ * returns every idle page of the heap to the os right away, after flushing the
+ * calling thread's cache. returns the number of bytes released.
+ */
+    ThreadCache* cache = _tcache_get();
+    for (unsigned int c = 0; c < SLAB_CLASSES; c++) {
+        _slab_flush(cache, c, cache->slab_counts[c]);
+    }
+    for (unsigned int d = 0; d <= TCACHE_MAX_DEG; d++) {
+        _tcache_flush(cache, d, cache->counts[d]);
+    }
+    size_t released = 0;
+    unsigned int n = _get_arena_num();
+    for (unsigned int a = 0; a < n; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+        _drain_remote_frees(&arenas[a]);
+        _coalesce_deferred(&arenas[a]);
+        released += _release_free_memory(&arenas[a]);
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+
+    pthread_mutex_lock(&mmap_cache_lock);
+    released += mmap_cache_bytes;
+    while (mmap_cache_blocks) {
+        _mmap_cache_evict_oldest();
+    }
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return released;
+}
+
+void _set_mmap_cache_limits(size_t max_bytes, size_t max_age_ms) {
+    pthread_mutex_lock(&mmap_cache_lock);
+    mmap_cache_max_bytes = max_bytes;
+    mmap_cache_max_age = max_age_ms;
+    _mmap_cache_sweep(_now_ms());
+    while (mmap_cache_bytes > mmap_cache_max_bytes) {
+        _mmap_cache_evict_oldest();
+    }
+    pthread_mutex_unlock(&mmap_cache_lock);
+}
+
+size_t _num_mmap_cache_hits() {
+    pthread_mutex_lock(&mmap_cache_lock);
+    size_t count = mmap_cache_hits;
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return count;
+}
+
+size_t _num_mmap_cache_misses() {
+    pthread_mutex_lock(&mmap_cache_lock);
+    size_t count = mmap_cache_misses;
+    pthread_mutex_unlock(&mmap_cache_lock);
+    return count;
+}
+
+bool _is_readable(const void* p, size_t size) {
+/*
+ * tells whether size bytes at p can be read, by copying them out of this very process.
+ * mincore would not do, it succeeds on PROT_NONE pages such as the uncommitted part of
+ * the heap reservation. when the kernel refuses the call the memory counts as unreadable.
+ */
+    char buf[64];
+    if (size > sizeof(buf)) return false;
+    struct iovec local = {buf, size};
+    struct iovec remote = {(void*)p, size};
+    return syscall(SYS_process_vm_readv, getpid(), &local, 1, &remote, 1, 0) == (long)size;
+}
+
+bool _owns_block(void* p) {
+/*
+ * tells whether p is a live pointer returned by this allocator, without touching
+ * memory that may not be mapped. foreign pointers (from another allocator, the
+ * stack or static storage) return false.
+ */
+    Slab* slab = _get_slab(p);
+    if (slab) {
+        size_t offset = (char*)p - ((char*)slab + SLAB_HEADER_SIZE);
+        return (char*)p >= (char*)slab + SLAB_HEADER_SIZE
+            && offset % slab_sizes[slab->size_class] == 0
+            && offset / slab_sizes[slab->size_class] < slab->capacity;
+    }
+
+#if COMPACT_META
+    if (_in_heap(p) || _in_heap((char*)p - sizeof(MallocMetaData))) {
+        // heap blocks have no header, their byte in the side table tells.
+        if (!_in_heap(p)) return false;
+        MallocMetaData* block = (MallocMetaData*)p;
+        size_t offset = (char*)block - superblocks[_get_superblock_index(block)].base;
+        return offset % MIN_BLOCK_SIZE == 0 && (_get_block_state(block) & ~BLOCK_SAMPLED) == BLOCK_ALLOCATED
+            && offset % _get_block_size(_get_block_degree(block)) == 0;
+    }
+#endif
+
+    MallocMetaData* block = (MallocMetaData*)((char*)p - sizeof(MallocMetaData));
+    char* heap = heap_base;
+    SuperBlock* sb = nullptr;
+    if (heap && (char*)block >= heap && (size_t)((char*)block - heap) / SUPERBLOCK_SIZE < MAX_SUPERBLOCKS) {
+        sb = &superblocks[(size_t)((char*)block - heap) / SUPERBLOCK_SIZE];
+        if (!sb->base) return false;
+    }
+
+    // the stub of an aligned payload may sit on the page before p.
+    if ((sb || ((uintptr_t)p & 4095) >= sizeof(MallocMetaData) || _is_readable(block, sizeof(MallocMetaData)))
+        && block->degree == ALIGNED_DEG
+        && block->magic == (ALIGNED_MAGIC ^ (unsigned int)((uintptr_t)block >> 12))) {
+        return block->next < block && _owns_block((char*)block->next + sizeof(MallocMetaData));
+    }
+
+    if (sb) {
+        size_t offset = (char*)block - sb->base;
+        return offset % MIN_BLOCK_SIZE == 0 && block->degree <= MAX_DEG
+            && offset % _get_block_size(block->degree) == 0
+            && !block->is_mmap && !block->is_free && !block->is_cached;
+    }
+
+    // the header of an mmap'd block shares the first page with the payload.
+    if (((uintptr_t)p & 4095) != sizeof(MallocMetaData)) return false;
+    return block->is_mmap && !block->is_cached
+        && block->magic == (MMAP_MAGIC ^ (unsigned int)((uintptr_t)block >> 12));
+}
+
+size_t _num_thp_heap_bytes() {
+    pthread_mutex_lock(&heap_lock);
+    size_t count = thp_heap_bytes;
+    pthread_mutex_unlock(&heap_lock);
+    return count;
+}
+
+size_t _size_meta_data() {
+    return BLOCK_HEADER_SIZE;
+}
+
+size_t _num_meta_data_bytes() {
+    // slab objects have no header, their slab has one.
+    pthread_mutex_lock(&slab_lock);
+    size_t objects = slab_objects;
+    size_t slab_meta_bytes = slab_num * SLAB_HEADER_SIZE;
+    pthread_mutex_unlock(&slab_lock);
+#if COMPACT_META
+    // neither have heap blocks, the side tables of the superblocks stand for them.
+    (void)objects;
+    pthread_mutex_lock(&heap_lock);
+    size_t table_bytes = superblock_num * sizeof(SuperBlock::block_info);
+    pthread_mutex_unlock(&heap_lock);
+    return mapped_blocks_num.load(std::memory_order_relaxed) * sizeof(MallocMetaData) + table_bytes + slab_meta_bytes;
+#else
+    return (_num_allocated_blocks() - objects) * _size_meta_data() + slab_meta_bytes;
+#endif
+}
+
+// reports the blocks of one superblock, the lock of its arena and slab_lock must be held.
+void _walk_superblock(SuperBlock* sb, void (*visit)(const HeapBlock* block, void* arg), void* arg) {
+    for (char* p = sb->base; p < sb->base + SUPERBLOCK_SIZE; ) {
+        MallocMetaData* block = (MallocMetaData*)p;
+        HeapBlock info = {p, 0, 0, 0, BLOCK_FREE, false, false};
+        // a free block is only known by its bit, its header is stale.
+        int d = MAX_DEG;
+        while (d >= 0 && (((size_t)(p - sb->base) & (_get_block_size(d) - 1)) || !_is_free_block(block, d))) {
+            d--;
+        }
+        if (d >= 0) {
+            info.degree = d;
+        } else {
+            info.degree = _get_block_degree(block);
+            info.state = _get_block_state(block) & ~BLOCK_SAMPLED;
+            Slab* slab = _get_slab(p);
+            if (slab) {
+                info.is_slab = true;
+                info.size = (slab->capacity - slab->free_objects) * slab_sizes[slab->size_class];
+            }
+#if !COMPACT_META
+            else if (info.state == BLOCK_ALLOCATED) {
+                info.size = block->size;
+            }
+#endif
+        }
+        info.block_size = _get_block_size(info.degree);
+        visit(&info, arg);
+        p += info.block_size;
+    }
+}
+
+void _heap_walk(void (*visit)(const HeapBlock* block, void* arg), void* arg) {
+/*
+ * calls visit for every block of every superblock, free ones included, then for every
+ * mapping. the arenas, the slabs and the mappings are locked while theirs are visited,
+ * so visit must not allocate or free. a block going in or out of a thread cache at the
+ * same time may be reported in either state.
+ */
+    unsigned int n = _get_arena_num();
+    pthread_mutex_lock(&slab_lock);
+    for (unsigned int a = 0; a < n; a++) {
+        Arena* arena = &arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        _drain_remote_frees(arena);
+        for (size_t w = 0; w < (MAX_SUPERBLOCKS + 63) / 64; w++) {
+            for (uint64_t owned = arena->owned[w]; owned; owned &= owned - 1) {
+                _walk_superblock(&superblocks[w * 64 + __builtin_ctzll(owned)], visit, arg);
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    pthread_mutex_lock(&mapped_lock);
+    for (size_t i = 0; i < mapped_slots; i++) {
+        if (mapped_table[i] & 1) continue;
+        MallocMetaData* block = (MallocMetaData*)mapped_table[i];
+        HeapBlock info = {block, block->map_size, 0, MAX_DEG + 1, BLOCK_CACHED, true, false};
+        if (!block->is_cached) {
+            info.state = BLOCK_ALLOCATED;
+            info.size = block->size;
+        }
+        visit(&info, arg);
+    }
+    pthread_mutex_unlock(&mapped_lock);
+}
+
+void _add_fragmentation(const HeapBlock* block, void* arg) {
+    HeapFragmentation* frag = (HeapFragmentation*)arg;
+    if (block->state == BLOCK_CACHED) {
+        frag->cached_bytes += block->block_size;
+    } else if (block->state == BLOCK_FREE) {
+        frag->free_bytes += block->block_size;
+        frag->free_blocks[block->degree]++;
+        frag->largest_free = std::max(frag->largest_free, block->block_size);
+    } else {
+        frag->allocated_bytes += block->block_size;
+        if (block->size) {
+            frag->sized_bytes += block->block_size;
+            frag->requested_bytes += block->size;
+        }
+    }
+}
+
+void _heap_fragmentation(HeapFragmentation* frag) {
+/*
+ * walks the heap and fills frag. internal waste is what allocated blocks hold past the
+ * size asked for, over the blocks whose size is known: mappings, slabs and,
+ * with headers, heap blocks. external fragmentation is the share of the free heap
+ * bytes outside the biggest free block, none of which can serve a request that big.
+ */
+    memset(frag, 0, sizeof(*frag));
+    _heap_walk(_add_fragmentation, frag);
+    frag->internal_waste = frag->sized_bytes - frag->requested_bytes;
+    if (frag->sized_bytes) {
+        frag->internal_ratio = (double)frag->internal_waste / frag->sized_bytes;
+    }
+    if (frag->free_bytes) {
+        frag->external_ratio = 1.0 - (double)frag->largest_free / frag->free_bytes;
+    }
+}
+
+void _heap_snapshot(HeapSnapshot* snapshot) {
+/*
+ * fills snapshot without taking a lock or walking anything, cheap enough to export
+ * every second. the block counts trail the _num_* functions by what live threads did
+ * in their caches since they last took a lock.
+ */
+    snapshot->active_blocks = published_blocks.load(std::memory_order_relaxed);
+    snapshot->allocated_bytes = published_bytes.load(std::memory_order_relaxed);
+    snapshot->cached_blocks = published_cached_blocks.load(std::memory_order_relaxed);
+    snapshot->cached_bytes = published_cached_bytes.load(std::memory_order_relaxed);
+    snapshot->heap_bytes = heap_bytes.load(std::memory_order_relaxed);
+    snapshot->free_heap_bytes = 0;
+    for (unsigned int a = 0; a < MAX_ARENAS; a++) {
+        snapshot->free_heap_bytes += arenas[a].free_bytes.load(std::memory_order_relaxed);
+    }
+    snapshot->mapped_blocks = mapped_blocks_num.load(std::memory_order_relaxed);
+    snapshot->mapped_bytes = mapped_bytes.load(std::memory_order_relaxed);
+}
+
+#ifdef SMALLOC_NAMESPACE
+}  // namespace SMALLOC_NAMESPACE
+#endif
+
+#endif
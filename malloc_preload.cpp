@@ -0,0 +1,403 @@
+/*
+ * LD_PRELOAD shim exporting the libc allocation interface on top of malloc_4.
+ *
+ *   g++ -std=c++17 -O2 -fPIC -shared -ftls-model=initial-exec \
+ *       malloc_4.cpp malloc_preload.cpp -o libsmalloc.so -lpthread
+ *   LD_PRELOAD=./libsmalloc.so ./program
+ *
+ * requests the engine cannot serve (over 100MB, or when the heap or a huge page
+ * mapping is not available) get a plain mapping of their own. pointers the shim
+ * does not recognise, like those handed out by the dynamic loader before the
+ * shim was bound, are never passed to the engine: free ignores them and realloc
+ * copies out whatever of them is mapped.
+ *
+ * with SMALLOC_TRACE=path in the environment every call is recorded to path, see
+ * _trace_start, for replay with malloc_bench. with SMALLOC_PROFILE=path the heap
+ * profiler samples one allocation per PROFILE_SAMPLE bytes, SIGUSR2 dumps the profile
+ * to path.<n>.heap and it is dumped to path at exit, see _prof_dump.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <csignal>
+
+#define MAX_ENGINE_SIZE 100000000  // smalloc refuses anything larger
+#define BIG_MAGIC 0x62696721u       // tags the header of a shim mapping
+#define BIG_OFFSET 64               // payload offset inside a shim mapping
+#define PAGE_SIZE 4096
+#define ALIGNED_TABLE_MIN 1024      // initial slots of the aligned pointer table
+#define PROFILE_SAMPLE (512 * 1024) // bytes between heap profile samples
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+void* smemalign(size_t alignment, size_t size);
+size_t _trim();
+bool _trace_start(const char* path);
+void _trace_stop();
+bool _prof_start(size_t sample_bytes);
+bool _prof_dump(const char* path);
+bool _prof_dump_on_signal(int signo, const char* path);
+
+static const char* profile_path;
+bool _owns_block(void* p);
+bool _is_readable(const void* p, size_t size);
+size_t _usable_size(void* p);
+
+// header of a mapping made by the shim itself.
+struct BigHeader {
+    unsigned int magic;
+    size_t length;
+};
+
+// an aligned pointer handed out from inside a shim mapping.
+struct AlignedEntry {
+    void* aligned;  // nullptr when empty, ALIGNED_DELETED when removed
+    void* base;
+};
+
+#define ALIGNED_DELETED ((void*)1)
+
+static pthread_mutex_t aligned_lock = PTHREAD_MUTEX_INITIALIZER;
+static AlignedEntry* aligned_table;
+static size_t aligned_slots;
+static size_t aligned_used;  // live and deleted entries
+
+void* _big_alloc(size_t size) {
+    if (size > SIZE_MAX - BIG_OFFSET - PAGE_SIZE) return nullptr;
+    size_t length = (size + BIG_OFFSET + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    BigHeader* header = (BigHeader*)p;
+    header->magic = BIG_MAGIC ^ (unsigned int)((uintptr_t)p >> 12);
+    header->length = length;
+    return (char*)p + BIG_OFFSET;
+}
+
+BigHeader* _get_big(void* p) {
+    if (((uintptr_t)p & (PAGE_SIZE - 1)) != BIG_OFFSET) return nullptr;
+    BigHeader* header = (BigHeader*)((char*)p - BIG_OFFSET);
+    if (header->magic != (BIG_MAGIC ^ (unsigned int)((uintptr_t)header >> 12))) return nullptr;
+    return header;
+}
+
+size_t _aligned_hash(void* aligned) {
+    return ((uintptr_t)aligned >> 6) * 0x9e3779b97f4a7c15ULL;
+}
+
+// aligned_lock must be held.
+bool _aligned_grow() {
+    size_t slots = aligned_slots ? aligned_slots * 2 : ALIGNED_TABLE_MIN;
+    void* p = mmap(nullptr, slots * sizeof(AlignedEntry), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return false;
+    AlignedEntry* table = (AlignedEntry*)p;
+    aligned_used = 0;
+    for (size_t i = 0; i < aligned_slots; i++) {
+        void* aligned = aligned_table[i].aligned;
+        if (!aligned || aligned == ALIGNED_DELETED) continue;
+        size_t j = _aligned_hash(aligned) & (slots - 1);
+        while (table[j].aligned) {
+            j = (j + 1) & (slots - 1);
+        }
+        table[j] = aligned_table[i];
+        aligned_used++;
+    }
+    if (aligned_table) {
+        munmap(aligned_table, aligned_slots * sizeof(AlignedEntry));
+    }
+    aligned_table = table;
+    aligned_slots = slots;
+    return true;
+}
+
+bool _aligned_insert(void* aligned, void* base) {
+    pthread_mutex_lock(&aligned_lock);
+    if ((aligned_used + 1) * 4 > aligned_slots * 3 && !_aligned_grow()) {
+        pthread_mutex_unlock(&aligned_lock);
+        return false;
+    }
+    size_t i = _aligned_hash(aligned) & (aligned_slots - 1);
+    while (aligned_table[i].aligned && aligned_table[i].aligned != ALIGNED_DELETED) {
+        i = (i + 1) & (aligned_slots - 1);
+    }
+    if (!aligned_table[i].aligned) {
+        aligned_used++;
+    }
+    aligned_table[i].aligned = aligned;
+    aligned_table[i].base = base;
+    pthread_mutex_unlock(&aligned_lock);
+    return true;
+}
+
+// returns the mapping holding an aligned pointer, removing it when asked to.
+void* _aligned_lookup(void* aligned, bool remove) {
+    void* base = nullptr;
+    pthread_mutex_lock(&aligned_lock);
+    if (aligned_slots) {
+        size_t i = _aligned_hash(aligned) & (aligned_slots - 1);
+        while (aligned_table[i].aligned) {
+            if (aligned_table[i].aligned == aligned) {
+                base = aligned_table[i].base;
+                if (remove) {
+                    aligned_table[i].aligned = ALIGNED_DELETED;
+                }
+                break;
+            }
+            i = (i + 1) & (aligned_slots - 1);
+        }
+    }
+    pthread_mutex_unlock(&aligned_lock);
+    return base;
+}
+
+// bytes readable from a pointer of unknown origin, up to max.
+size_t _foreign_size(void* p, size_t max) {
+    char* page = (char*)((uintptr_t)p & ~(uintptr_t)(PAGE_SIZE - 1));
+    size_t size = page + PAGE_SIZE - (char*)p;
+    while (size < max && _is_readable((char*)p + size, 1)) {
+        size += PAGE_SIZE;
+    }
+    return size < max ? size : max;
+}
+
+extern "C" {
+
+void* malloc(size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    void* p = size <= MAX_ENGINE_SIZE ? smalloc(size) : nullptr;
+    if (!p) {
+        p = _big_alloc(size);
+    }
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* p) {
+    if (!p) return;
+    if (_owns_block(p)) {
+        sfree(p);
+        return;
+    }
+    void* base = _aligned_lookup(p, true);
+    if (base) {
+        free(base);
+        return;
+    }
+    BigHeader* header = _get_big(p);
+    if (header) {
+        munmap(header, header->length);
+    }
+}
+
+size_t malloc_usable_size(void* p) {
+    if (!p) return 0;
+    if (_owns_block(p)) return _usable_size(p);
+    void* base = _aligned_lookup(p, false);
+    if (base) return malloc_usable_size(base) - ((char*)p - (char*)base);
+    BigHeader* header = _get_big(p);
+    if (header) return header->length - BIG_OFFSET;
+    return 0;
+}
+
+void* calloc(size_t num, size_t size) {
+    if (size && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    size_t total_size = num * size;
+    if (total_size == 0) {
+        total_size = 1;
+    }
+    if (total_size <= MAX_ENGINE_SIZE) {
+        void* p = scalloc(1, total_size);
+        if (p) return p;
+        p = smalloc(total_size);
+        if (p) {
+            memset(p, 0, total_size);
+            return p;
+        }
+    }
+    // fresh mappings are already zeroed.
+    void* p = _big_alloc(total_size);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* oldp, size_t size) {
+    if (!oldp) return malloc(size);
+    if (size == 0) {
+        free(oldp);
+        return nullptr;
+    }
+
+    size_t old_size;
+    if (_owns_block(oldp)) {
+        if (size <= MAX_ENGINE_SIZE) {
+            void* p = srealloc(oldp, size);
+            if (p) return p;
+        }
+        old_size = _usable_size(oldp);
+    } else {
+        old_size = malloc_usable_size(oldp);
+        if (!old_size) {
+            old_size = _foreign_size(oldp, size);
+        }
+    }
+
+    void* p = malloc(size);
+    if (!p) return nullptr;
+    memcpy(p, oldp, old_size < size ? old_size : size);
+    free(oldp);
+    return p;
+}
+
+void* reallocarray(void* oldp, size_t num, size_t size) {
+    if (size && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(oldp, num * size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    if (size <= MAX_ENGINE_SIZE) {
+        void* p = smemalign(alignment, size);
+        if (p) return p;
+    }
+
+    // too big for the engine, cut it out of a shim mapping.
+    if (size > SIZE_MAX - alignment) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    void* base = _big_alloc(size + alignment);
+    if (!base) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* aligned = (void*)(((uintptr_t)base + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (aligned == base) {
+        aligned = (char*)base + alignment;
+    }
+    if (!_aligned_insert(aligned, base)) {
+        free(base);
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return aligned;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))) return EINVAL;
+    void* p = memalign(alignment, size);
+    if (!p) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) {
+    return memalign(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1));
+}
+
+int malloc_trim(size_t pad) {
+    (void)pad;
+    return _trim() > 0;
+}
+
+}
+
+__attribute__((constructor)) static void _preload_init() {
+    const char* path = getenv("SMALLOC_TRACE");
+    if (path && *path) {
+        _trace_start(path);
+    }
+    profile_path = getenv("SMALLOC_PROFILE");
+    if (profile_path && *profile_path) {
+        _prof_dump_on_signal(SIGUSR2, profile_path);
+        _prof_start(PROFILE_SAMPLE);
+    }
+}
+
+__attribute__((destructor)) static void _preload_fini() {
+    _trace_stop();
+    if (profile_path && *profile_path) {
+        _prof_dump(profile_path);
+    }
+}
+
+void* _new(size_t size, size_t alignment, bool is_nothrow) {
+    while (true) {
+        void* p = alignment ? memalign(alignment, size) : malloc(size);
+        if (p) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            if (is_nothrow) return nullptr;
+            throw std::bad_alloc();
+        }
+        if (is_nothrow) {
+            try {
+                handler();
+            } catch (const std::bad_alloc&) {
+                return nullptr;
+            }
+        } else {
+            handler();
+        }
+    }
+}
+
+void* operator new(size_t size) { return _new(size, 0, false); }
+void* operator new[](size_t size) { return _new(size, 0, false); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return _new(size, 0, true); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return _new(size, 0, true); }
+void* operator new(size_t size, std::align_val_t al) { return _new(size, (size_t)al, false); }
+void* operator new[](size_t size, std::align_val_t al) { return _new(size, (size_t)al, false); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return _new(size, (size_t)al, true);
+}
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return _new(size, (size_t)al, true);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { free(p); }